@@ -0,0 +1,160 @@
+/*
+ * arena.c - Region allocation on top of the mm package
+ *
+ * An arena is a list of chunks taken from mm_malloc, newest first, and a
+ * bump pointer through the free space of the current one. The first
+ * chunk holds the arena itself. A request that does not fit what is left
+ * of the current chunk starts a new one, unless it would take more than
+ * a quarter of a chunk: then it gets a chunk of its own, and the current
+ * chunk keeps serving the small requests that follow.
+ */
+#include <stdint.h>
+
+#include "arena.h"
+#include "mm.h"
+
+/* Objects are aligned like mm_malloc's: 8 bytes on i386, 16 on x86-64 */
+#define ARENA_ALIGN (2 * sizeof(void *))
+#define ALIGN(size) (((size) + (ARENA_ALIGN - 1)) & ~(ARENA_ALIGN - 1))
+
+/* Smallest chunk arena_create accepts */
+#define ARENA_MIN_CHUNK 1024
+
+typedef struct chunk {
+  struct chunk *next;
+} chunk_t;
+
+struct arena {
+  chunk_t *chunks;   /* every chunk, newest first */
+  char *top;         /* free space of the current chunk */
+  char *end;         /* ... and its end */
+  size_t chunk_size; /* bytes of a chunk, header included */
+};
+
+/* Bytes before the first object of a chunk and of the first chunk */
+#define CHUNK_HDR ALIGN(sizeof(chunk_t))
+#define FIRST_HDR (CHUNK_HDR + ALIGN(sizeof(struct arena)))
+
+/*
+ * new_chunk - Take a chunk of size bytes from mm_malloc and put it at
+ *     the head of the arena's list
+ */
+static chunk_t *new_chunk(arena_t *arena, size_t size) {
+  chunk_t *chunk = mm_malloc(size);
+
+  if (chunk == NULL)
+    return NULL;
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  return chunk;
+}
+
+/*
+ * grow - Serve a request that does not fit the current chunk
+ */
+static void *grow(arena_t *arena, size_t align, size_t size) {
+  size_t slack = align - ARENA_ALIGN; /* to align an object in a chunk */
+  chunk_t *chunk;
+  char *p;
+
+  if (size > SIZE_MAX - CHUNK_HDR - slack - ARENA_ALIGN)
+    return NULL;
+  if (size + slack > arena->chunk_size / 4) {
+    if ((chunk = new_chunk(arena, CHUNK_HDR + slack + ALIGN(size))) == NULL)
+      return NULL;
+    p = (char *)chunk + CHUNK_HDR;
+    return (void *)(((uintptr_t)p + slack) & ~(uintptr_t)(align - 1));
+  }
+
+  if ((chunk = new_chunk(arena, arena->chunk_size)) == NULL)
+    return NULL;
+  p = (char *)chunk + CHUNK_HDR;
+  p = (char *)(((uintptr_t)p + slack) & ~(uintptr_t)(align - 1));
+  arena->top = p + ALIGN(size);
+  arena->end = (char *)chunk + arena->chunk_size;
+  return p;
+}
+
+/*
+ * arena_create - Take the first chunk and set the arena up in it
+ */
+arena_t *arena_create(size_t chunk_size) {
+  chunk_t *first;
+  arena_t *arena;
+
+  if (chunk_size == 0)
+    chunk_size = ARENA_CHUNK_SIZE;
+  if (chunk_size < ARENA_MIN_CHUNK)
+    chunk_size = ARENA_MIN_CHUNK;
+  if (chunk_size > SIZE_MAX - ARENA_ALIGN)
+    return NULL;
+  chunk_size = ALIGN(chunk_size);
+
+  if ((first = mm_malloc(chunk_size)) == NULL)
+    return NULL;
+  first->next = NULL;
+  arena = (arena_t *)((char *)first + CHUNK_HDR);
+  arena->chunks = first;
+  arena->top = (char *)first + FIRST_HDR;
+  arena->end = (char *)first + chunk_size;
+  arena->chunk_size = chunk_size;
+  return arena;
+}
+
+/*
+ * arena_alloc - Bump the pointer, or leave it to arena_memalign when the
+ *     current chunk is too full (or size is 0)
+ */
+void *arena_alloc(arena_t *arena, size_t size) {
+  char *p = arena->top;
+
+  // size is 1 to the free bytes; they are a multiple of ARENA_ALIGN
+  if (size - 1 < (size_t)(arena->end - p)) {
+    arena->top = p + ALIGN(size);
+    return p;
+  }
+  return arena_memalign(arena, ARENA_ALIGN, size);
+}
+
+/*
+ * arena_memalign - Align the bump pointer and carve, or grow
+ */
+void *arena_memalign(arena_t *arena, size_t align, size_t size) {
+  char *p;
+
+  if (size == 0 || align == 0 || (align & (align - 1)) != 0)
+    return NULL;
+  if (align < ARENA_ALIGN)
+    align = ARENA_ALIGN;
+
+  p = (char *)(((uintptr_t)arena->top + align - 1) & ~(uintptr_t)(align - 1));
+  if (p <= arena->end && size <= (size_t)(arena->end - p)) {
+    arena->top = p + ALIGN(size);
+    return p;
+  }
+  return grow(arena, align, size);
+}
+
+/*
+ * arena_reset - Free all chunks but the first and empty that one
+ */
+void arena_reset(arena_t *arena) {
+  chunk_t *first = (chunk_t *)((char *)arena - CHUNK_HDR);
+  chunk_t *chunk, *next;
+
+  for (chunk = arena->chunks; chunk != first; chunk = next) {
+    next = chunk->next;
+    mm_free(chunk);
+  }
+  arena->chunks = first;
+  arena->top = (char *)first + FIRST_HDR;
+  arena->end = (char *)first + arena->chunk_size;
+}
+
+/*
+ * arena_destroy - Free every chunk, the one holding the arena last
+ */
+void arena_destroy(arena_t *arena) {
+  arena_reset(arena);
+  mm_free(arena->chunks);
+}
@@ -0,0 +1,41 @@
+/*
+ * arena.h - region allocation on top of the mm package
+ *
+ * An arena serves objects that die together, such as the data of one
+ * request. arena_alloc bumps a pointer through large chunks that the
+ * arena takes from mm_malloc, and arena_reset or arena_destroy gives them
+ * all back at once. Objects carry no header and are never freed one by
+ * one. An arena must not be used by two threads at once; with
+ * MM_THREAD_SAFE, different threads may use arenas of their own.
+ */
+#include <stddef.h>
+
+/* Bytes an arena asks mm_malloc for at a time, unless told otherwise */
+#ifndef ARENA_CHUNK_SIZE
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#endif
+
+typedef struct arena arena_t;
+
+/*
+ * arena_create - Return an empty arena that grows chunk_size bytes at a
+ *     time (ARENA_CHUNK_SIZE if 0, and at least 1 KB), or NULL if
+ *     mm_malloc fails. A request too large to share a chunk gets a chunk
+ *     of its own.
+ */
+extern arena_t *arena_create(size_t chunk_size);
+
+/*
+ * arena_alloc - Return size bytes aligned like mm_malloc's, or NULL if
+ *     size is 0 or mm_malloc fails. arena_memalign returns them at a
+ *     multiple of align, a power of two, or NULL for any other align.
+ */
+extern void *arena_alloc(arena_t *arena, size_t size);
+extern void *arena_memalign(arena_t *arena, size_t align, size_t size);
+
+/*
+ * arena_reset - Free every object of the arena at once. The first chunk
+ *     is kept for the objects to come. arena_destroy frees the arena too.
+ */
+extern void arena_reset(arena_t *arena);
+extern void arena_destroy(arena_t *arena);
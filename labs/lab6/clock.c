@@ -20,9 +20,10 @@
  * You can verify this for yourself using gcc -v.
  *******************************************************/
 
-#if defined(__i386__)
+#if defined(__i386__) || defined(__x86_64__)
 /*******************************************************
  * Pentium versions of start_counter() and get_counter()
+ * (rdtsc behaves the same in 64-bit mode)
  *******************************************************/
 
 /* $begin x86cyclecounter */
@@ -65,6 +66,14 @@ double get_counter() {
 }
 /* $end x86cyclecounter */
 
+/* Return the whole 64-bit cycle counter */
+unsigned long long read_counter() {
+  unsigned hi, lo;
+
+  access_counter(&hi, &lo);
+  return ((unsigned long long)hi << 32) | lo;
+}
+
 #elif defined(__alpha)
 
 /****************************************************
@@ -119,6 +128,10 @@ double get_counter() {
   return result;
 }
 
+unsigned long long read_counter() {
+  return counter();
+}
+
 #else
 
 /****************************************************************
@@ -142,6 +155,12 @@ double get_counter() {
   printf("Please choose another timing package in config.h.\n");
   exit(1);
 }
+
+unsigned long long read_counter() {
+  printf("ERROR: You are trying to use a read_counter routine in clock.c\n");
+  printf("that has not been implemented yet on this platform.\n");
+  exit(1);
+}
 #endif
 
 /*******************************
@@ -6,6 +6,9 @@ void start_counter();
 /* Get # cycles since counter started */
 double get_counter();
 
+/* Read the whole cycle counter, e.g. to time a single short call */
+unsigned long long read_counter();
+
 /* Measure overhead for counter */
 double ovhd();
 
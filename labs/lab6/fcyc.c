@@ -124,6 +124,7 @@ static void clear() {
  */
 double fcyc(test_funct f, void *argp) {
   double result;
+  int tries = 0;
   init_sampler();
   if (compensate) {
     do {
@@ -133,8 +134,11 @@ double fcyc(test_funct f, void *argp) {
       start_comp_counter();
       f(argp);
       cyc = get_comp_counter();
-      add_sample(cyc);
-    } while (!has_converged() && samplecount < maxsamples);
+      /* A run preempted by another process can be over-compensated */
+      if (cyc > 0)
+        add_sample(cyc);
+    } while (!has_converged() && samplecount < maxsamples &&
+             ++tries < 2 * maxsamples);
   } else {
     do {
       double cyc;
@@ -0,0 +1,98 @@
+/*
+ * fperf.c - Count the hardware events caused by a function f
+ *
+ * Uses Linux's perf_event_open to count the cycles, instructions, L1
+ * data cache, last-level cache and data TLB misses, and page faults of
+ * f. Every event has a counter of its own, so an event the CPU lacks
+ * does not keep the others from being counted, and the kernel may
+ * multiplex them; the counts are scaled up to the whole run then.
+ */
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "fperf.h"
+
+/* Read misses of a generic cache, as a PERF_TYPE_HW_CACHE config */
+#define READ_MISSES(cache)                                                     \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                              \
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+char *fperf_names[FPERF_EVENTS] = {"cycles",   "instrs",    "L1d-miss",
+                                   "LLC-miss", "dTLB-miss", "faults"};
+
+/* The perf_event_attr type and config of each event */
+static unsigned types[FPERF_EVENTS] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+    PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_SOFTWARE};
+static unsigned long long configs[FPERF_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    READ_MISSES(PERF_COUNT_HW_CACHE_L1D),
+    PERF_COUNT_HW_CACHE_MISSES,
+    READ_MISSES(PERF_COUNT_HW_CACHE_DTLB),
+    PERF_COUNT_SW_PAGE_FAULTS};
+
+/* Counter of each event, or -1, and the process that opened them */
+static int fds[FPERF_EVENTS];
+static pid_t owner = 0;
+
+/*
+ * open_counters - Open a disabled counter for every event in this
+ *     process. A child of fork inherits counters that count its parent,
+ *     so those are closed first.
+ */
+static void open_counters(void) {
+  struct perf_event_attr attr;
+  int e;
+
+  for (e = 0; e < FPERF_EVENTS; e++) {
+    if (owner != 0 && fds[e] >= 0)
+      close(fds[e]);
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = types[e];
+    attr.config = configs[e];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  owner = getpid();
+}
+
+/*
+ * fperf - Count the events of n runs of f and average them
+ */
+int fperf(fperf_test_funct f, void *argp, int n, double *counts) {
+  unsigned long long val[3]; /* count, time enabled, time running */
+  int e, i, events = 0;
+
+  if (owner != getpid())
+    open_counters();
+  for (e = 0; e < FPERF_EVENTS; e++) {
+    counts[e] = (fds[e] < 0) ? -1 : 0;
+    events += (fds[e] >= 0);
+  }
+
+  for (i = 0; i < n; i++) {
+    for (e = 0; e < FPERF_EVENTS; e++)
+      if (fds[e] >= 0) {
+        ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+      }
+    f(argp);
+    for (e = 0; e < FPERF_EVENTS; e++)
+      if (fds[e] >= 0)
+        ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+    for (e = 0; e < FPERF_EVENTS; e++)
+      if (fds[e] >= 0 && read(fds[e], val, sizeof(val)) == sizeof(val) &&
+          val[2] > 0)
+        counts[e] += (double)val[0] * val[1] / val[2] / n;
+  }
+  return events;
+}
@@ -0,0 +1,31 @@
+/*
+ * fperf.h - prototypes for the routines in fperf.c that count hardware
+ *     events (cycles, instructions, cache and TLB misses) and page faults
+ *     while a test function f runs
+ */
+
+/* The events counted, in the order of the counts array of fperf */
+enum {
+  FPERF_CYCLES,
+  FPERF_INSTRUCTIONS,
+  FPERF_L1D_MISSES,
+  FPERF_LLC_MISSES,
+  FPERF_DTLB_MISSES,
+  FPERF_PAGE_FAULTS,
+  FPERF_EVENTS
+};
+
+/* Short names of the events, e.g. for table headers */
+extern char *fperf_names[FPERF_EVENTS];
+
+/* The test function takes a generic pointer as input */
+typedef void (*fperf_test_funct)(void *);
+
+/*
+ * fperf - Run f(argp) n times and store the average count of each event
+ *     per run in counts, or -1 for an event that this machine does not
+ *     count (virtual machines often have no hardware counters, and the
+ *     kernel may forbid them, see perf_event_paranoid). Only events in
+ *     user mode are counted. Returns the number of events counted.
+ */
+int fperf(fperf_test_funct f, void *argp, int n, double *counts);
@@ -51,3 +51,13 @@ double fsecs(fsecs_test_funct f, void *argp) {
   return ftimer_gettod(f, argp, 10);
 #endif
 }
+
+/*
+ * fsecs_mhz - Return the clock rate of the cycle counter (in MHz),
+ *     measuring it here if the timing method did not need it
+ */
+double fsecs_mhz(void) {
+  if (Mhz == 0)
+    Mhz = mhz(verbose > 0);
+  return Mhz;
+}
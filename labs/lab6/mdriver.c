@@ -7,61 +7,112 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* for sched_setaffinity and the CPU_SET macros */
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <float.h>
+#include <limits.h>
+#include <malloc.h>
+#include <math.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "clock.h"
 #include "config.h"
+#include "fperf.h"
 #include "fsecs.h"
 #include "memlib.h"
 #include "mm.h"
+#include "trace.h"
+
+#if MM_THREAD_SAFE
+#include <pthread.h>
+#include <sys/time.h>
+#endif
 
 /**********************
  * Constants and macros
  **********************/
 
 /* Misc */
-#define MAXLINE 1024 /* max string size */
-#define HDRLINES 4   /* number of header lines in a trace file */
+#define MAXLINE 1024        /* max string size */
+#define HDRLINES 4          /* number of header lines in a trace file */
+#define RESIDENT_SAMPLES 20 /* rows of the -r memory report per trace */
+#define RANGE_CHUNK 4096    /* range records the pool allocates at a time */
+#define PERF_RUNS 5         /* runs the -p event counts are averaged over */
+#define PIPE_SLOTS 256      /* blocks in flight from a producer (-Q) */
+
+/*
+ * The score is relative to libc malloc measured on the same traces, but
+ * under AddressSanitizer, which every Makefile build has, libc malloc is
+ * the sanitizer's: the score then uses AVG_LIBC_THRUPUT from config.h,
+ * and libc malloc runs only for -l
+ */
+#if defined(__SANITIZE_ADDRESS__)
+#define LIBC_BASELINE 0
+#else
+#define LIBC_BASELINE 1
+#endif
+
+/*
+ * Latency histograms (-L) are log-linear, like HdrHistogram: every power
+ * of two is split into LAT_SUB buckets, so each recorded value is within
+ * 1/LAT_SUB of the truth
+ */
+#define LAT_SUB_BITS 6
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+#define LAT_TYPES 5 /* histograms for each kind of request in trace.h */
 #define LINENUM(i)                                                             \
   (i + 5) /* cnvt trace request nums to linenums (origin 1)                    \
            */
 
+/* What print_compare shows, unless it is the -p event of that number */
+enum { SHOW_UTIL = -2, SHOW_KOPS = -1 };
+
+/* Indexes of the built-in allocators */
+enum { BUILTIN_MM, BUILTIN_IMPLICIT, BUILTIN_LIBC, NUM_BUILTINS };
+
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p) ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p) ((((size_t)(p)) % ALIGNMENT) == 0)
 
 /******************************
  * The key compound data types
  *****************************/
 
-/* Records the extent of each block's payload */
+/*
+ * Records the extent of each block's payload. The records form a treap
+ * ordered by lo, with random priorities keeping it balanced.
+ */
 typedef struct range_t {
-  char *lo;             /* low payload address */
-  char *hi;             /* high payload address */
-  struct range_t *next; /* next list element */
+  char *lo;              /* low payload address */
+  char *hi;              /* high payload address */
+  unsigned prio;         /* heap order: no child has a higher priority */
+  struct range_t *left;  /* lower payloads (next record in the pool) */
+  struct range_t *right; /* higher payloads */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-  enum { ALLOC, FREE, REALLOC } type; /* type of request */
-  int index;                          /* index for free() to use later */
-  int size;                           /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
   int sugg_heapsize;   /* suggested heap size (unused) */
-  int num_ids;         /* number of alloc/realloc ids */
-  int num_ops;         /* number of distinct requests */
+  long num_ids;        /* number of alloc/realloc ids */
+  long num_ops;        /* number of distinct requests */
   int weight;          /* weight for this trace (unused) */
-  traceop_t *ops;      /* array of requests */
+  traceop_t *ops;      /* array of requests (traceop_t is in trace.h) */
   char **blocks;       /* array of ptrs returned by malloc/realloc... */
   size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+  void *map;           /* mapping of a binary trace that ops points into */
+  size_t map_len;      /* its length, or 0 if ops was read from text */
 } trace_t;
 
 /*
@@ -74,6 +125,85 @@ typedef struct {
   range_t *ranges;
 } speed_t;
 
+/*
+ * An allocator with the interface of mm.h. The eval_mm_ routines run the
+ * one that alloc points to: the mm package, libc malloc for the baseline,
+ * or each allocator given with -A in turn.
+ */
+typedef struct {
+  char *name; /* as printed in the results */
+  int (*init)(void);
+  void *(*malloc)(size_t size);
+  void (*free)(void *ptr);
+  void *(*realloc)(void *ptr, size_t size);
+  void *(*calloc)(size_t nmemb, size_t size);
+  void *(*memalign)(size_t align, size_t size); /* NULL if it has none */
+  int heap; /* takes its memory from memlib, which bounds its blocks */
+  unsigned long long (*lat)[LAT_BUCKETS]; /* latency histograms, or NULL */
+} allocator_t;
+
+#if MM_THREAD_SAFE
+/*
+ * Holds the state of one replay thread in the multi-threaded mode (-T).
+ * Every thread replays the whole trace against the shared mm heap with
+ * its own block arrays.
+ */
+typedef struct {
+  trace_t *trace;
+  int tid;             /* thread number, also seeds the fill pattern */
+  int check;           /* if set, verify block contents as we go */
+  int errors;          /* number of corrupted blocks seen */
+  int full;            /* set if the heap ran out of memory */
+  char **blocks;       /* this thread's ptrs returned by malloc/realloc... */
+  size_t *block_sizes; /* ... and the corresponding payload sizes */
+  struct pipe *pipe;   /* with -Q, the pair whose consumer frees, or NULL */
+} replay_t;
+
+/* A block on its way from a producer to its consumer (-Q) */
+typedef struct {
+  char *p;
+  int size;
+  char fill;
+} handoff_t;
+
+/*
+ * Holds one producer/consumer pair of the pipeline replay (-Q). The
+ * producer replays the allocations of the trace and hands every block the
+ * trace frees to its consumer through a ring of PIPE_SLOTS slots; the
+ * consumer checks and frees it. head and tail only ever grow.
+ */
+typedef struct pipe {
+  replay_t producer; /* the producer's side, run by pipe_producer */
+  handoff_t *ring;   /* blocks handed over but not yet freed */
+  unsigned int head; /* next slot the consumer takes */
+  unsigned int tail; /* next slot the producer fills */
+  int done;          /* set once the producer has handed everything */
+  int errors;        /* number of corrupted blocks the consumer saw */
+} pipe_t;
+#endif
+
+/*
+ * Holds the state of the arena replay (-R). The ops of the trace are cut
+ * into lifetimes of window ops; the blocks allocated during one share an
+ * arena, which is reset once the last of them is freed and is then
+ * reused by a later lifetime.
+ */
+typedef struct {
+  trace_t *trace;
+  long window;      /* ops per lifetime */
+  int check;        /* if set, verify block contents as we go */
+  int errors;       /* number of misaligned or corrupted blocks seen */
+  int full;         /* set if the heap ran out of room for the arenas */
+  arena_t **arenas; /* the arena of each lifetime, or NULL... */
+  long *live;       /* ... and its blocks not yet freed */
+  long *lifetime;   /* the lifetime each id was allocated in */
+  arena_t **spare;  /* reset arenas of lifetimes that are over */
+  long num_spare;
+  long created; /* arenas created in the last run... */
+  long resets;  /* ... the times they were reset */
+  int peak;     /* ... and the peak payload */
+} arena_replay_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
   /* defined for both libc malloc and student malloc package (mm.c) */
@@ -84,9 +214,20 @@ typedef struct {
   /* defined only for the student malloc package */
   double util; /* space utilization for this trace (always 0 for libc) */
 
+  /* events per run of the trace with -p, or -1 if not counted */
+  double perf[FPERF_EVENTS];
+
   /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+/* What a -j worker sends back to the parent for every trace it ran */
+typedef struct {
+  int tracenum; /* index of the trace in the tracefiles array */
+  int errors;   /* malloc_error calls made while running this trace */
+  stats_t libc; /* only filled in if libc malloc is run as well */
+  stats_t mm;
+} result_t;
+
 /********************
  * Global variables
  *******************/
@@ -94,6 +235,64 @@ int verbose = 0;       /* global flag for verbose output */
 static int errors = 0; /* number of errs found when running student malloc */
 char msg[MAXLINE];     /* for whenever we need to compose an error message */
 
+/* If set, eval_mm_util reports memory over time (set by -r) */
+static int resident_report = 0;
+
+/* Take an mm_stats sample every this many ops in eval_mm_util (set by -s) */
+static long stats_every = 0;
+
+/* Call mm_check every this many ops in eval_mm_valid (set by -C) */
+static long check_every = 0;
+
+/* Where the samples are written (set by -S), or NULL for no samples */
+static FILE *stats_out = NULL;
+
+/* If set, time every mm call and report its tail latency (set by -L) */
+static int latency_report = 0;
+
+/* If set, count the hardware events of the timed runs (set by -p) */
+static int perf_report = 0;
+
+/* Where -H writes percentile distributions over all traces, or NULL */
+static char *latency_file = NULL;
+
+/* Cycles per mm call of each type (as in trace.h), over all traces */
+static unsigned long long latency_hist[LAT_TYPES][LAT_BUCKETS];
+
+/* Names of the calls, in the order of the request types of trace.h */
+static char *call_names[LAT_TYPES] = {"malloc", "free", "realloc", "calloc",
+                                      "memalign"};
+
+/* Names of the mm_set_fit placement policies, for -F and -P */
+static char *fit_names[MM_FIT_POLICIES] = {"default", "first", "next", "best",
+                                           "good"};
+
+/* Probes of the good-fit policy (set by -F good:<n>) */
+static unsigned int fit_probes = MM_FIT_PROBES;
+
+/* Cores that the timing runs are pinned to (set by -c) */
+static int *timing_cpus = NULL;
+static int num_timing_cpus = 0;
+
+/*
+ * With -j, one pipe per pinned core (or a single one without -c) holding
+ * a token byte. A timing run takes the token of its core first, so no two
+ * timing runs ever share a core.
+ */
+static int (*core_tokens)[2] = NULL;
+
+/* Which -j worker this process is (0 in the parent and in serial runs) */
+static int worker_id = 0;
+
+/* Free range records, linked through their left pointers */
+static range_t *range_pool = NULL;
+
+/* State of the xorshift generator for the range treap priorities */
+static unsigned range_seed = 2463534242u;
+
+/* The standard input copied to a temporary file, for "-f -" */
+static FILE *stdin_trace = NULL;
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -104,33 +303,120 @@ static char *default_tracefiles[] = {DEFAULT_TRACEFILES, NULL};
  * Function prototypes
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size, int tracenum,
-                     int opnum);
+                     long opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *merge_ranges(range_t *l, range_t *r);
+static void split_ranges(range_t *t, char *lo, range_t **l, range_t **r);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static FILE *open_trace(char *path);
+static void map_trace(trace_t *trace, FILE *tracefile, tracehdr_t *hdr,
+                      char *path);
+static void parse_trace(trace_t *trace, FILE *tracefile, char *path);
 static void free_trace(trace_t *trace);
 
-/* Routines for evaluating the correctness and speed of libc malloc */
-static int eval_libc_valid(trace_t *trace, int tracenum);
-static void eval_libc_speed(void *ptr);
+/* libc malloc needs no initialization */
+static int libc_init(void);
+
+/* calloc for allocators that do not define one */
+static void *malloc_zeroed(size_t nmemb, size_t size);
+
+/* The implicit-list allocator of sandbox.c, built under these names */
+extern int implicit_init(void);
+extern void *implicit_malloc(size_t size);
+extern void implicit_free(void *ptr);
+extern void *implicit_realloc(void *ptr, size_t size);
+
+/* Makes the block that an ALLOC, CALLOC or MEMALIGN request asks for */
+static void *new_block(traceop_t *op);
 
 /* Routines for evaluating correctnes, space utilization, and speed
-   of the student's malloc package in mm.c */
+   of the allocator that alloc points to */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void free_live(trace_t *trace);
+static void sample_stats(int tracenum, long ops, int payload);
+
+/* Routines that measure the latency of single mm calls (-L and -H) */
+static void eval_mm_latency(trace_t *trace, int tracenum);
+static unsigned lat_bucket(unsigned long long cycles);
+static unsigned long long lat_value(unsigned bucket);
+static unsigned long long lat_percentile(unsigned long long *hist,
+                                         double pct);
+static void print_latency(unsigned long long (*hist)[LAT_BUCKETS]);
+static void write_latency(char *prefix);
+
+/* Routines for the multi-threaded scaling mode of the mm package (-T) */
+static void eval_mm_scaling(trace_t *trace, int tracenum, int max_threads);
+
+/* Routines for the producer/consumer replay of the mm package (-Q) */
+static void eval_mm_pipeline(trace_t *trace, int tracenum, int npipes);
+#if MM_THREAD_SAFE
+static void pipe_handoff(pipe_t *pp, char *p, int size, char fill);
+#endif
+
+/* Routines for the arena replay mode (-R) */
+static int arena_corrupt(char *p, int size, char fill);
+static void eval_arena_replay(void *ptr);
+static void eval_mm_arena(trace_t *trace, int tracenum, long window);
+
+/* Routines that run one whole trace, in this process or in -j workers */
+static void eval_mm_trace(allocator_t *a, char *tracefile, int tracenum,
+                          stats_t *stats, range_t **ranges);
+static void eval_parallel(char **tracefiles, int num_tracefiles,
+                          stats_t *libc_stats, stats_t *mm_stats, int njobs);
+
+/* These functions compare the placement policies of the mm package */
+static int parse_fit(char *arg);
+static void eval_fit_sweep(char **tracefiles, int num_tracefiles, int njobs);
+static void print_front(char *label, double *util, double *kops);
+
+/* These functions compare allocators side by side (-A) */
+static void parse_allocs(char *list);
+static void eval_compare(char **tracefiles, int num_tracefiles);
+static void print_compare(char *title, stats_t *stats, int num_tracefiles,
+                          int show);
+
+/* This function compares the heap on small and on huge pages (-B) */
+static void eval_backings(char **tracefiles, int num_tracefiles);
+
+/* These functions pin timing runs to the cores given with -c */
+static void parse_cpus(char *list);
+static void pin_timing(int on);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printperf(int n, stats_t *stats);
+static void print_events(double *counts, double ops);
 static void usage(void);
 static void unix_error(char *msg);
-static void malloc_error(int tracenum, int opnum, char *msg);
+static void malloc_error(int tracenum, long opnum, char *msg);
 static void app_error(char *msg);
 
+/***********************
+ * The allocators to run
+ **********************/
+
+/* The built-in allocators, in the order of the BUILTIN_ constants */
+static allocator_t builtins[NUM_BUILTINS] = {
+    {"mm", mm_init, mm_malloc, mm_free, mm_realloc, mm_calloc, mm_memalign, 1,
+     NULL},
+    {"implicit", implicit_init, implicit_malloc, implicit_free,
+     implicit_realloc, malloc_zeroed, NULL, 1, NULL},
+    {"libc", libc_init, malloc, free, realloc, calloc, memalign, 0, NULL}};
+
+/* The allocator that the eval_mm_ routines run */
+static allocator_t *alloc = &builtins[BUILTIN_MM];
+
+/* The allocators to compare side by side (set by -A) */
+static allocator_t *compared = NULL;
+static int num_compared = 0;
+
 /**************
  * Main routine
  **************/
@@ -143,20 +429,28 @@ int main(int argc, char **argv) {
   range_t *ranges = NULL;     /* keeps track of block extents for one trace */
   stats_t *libc_stats = NULL; /* libc stats for each trace */
   stats_t *mm_stats = NULL;   /* mm (i.e. student) stats for each trace */
-  speed_t speed_params;       /* input parameters to the xx_speed routines */
 
   /* int team_check = 1; /\* If set, check team structure (reset by -a) *\/ */
-  int run_libc = 0;   /* If set, run libc malloc (set by -l) */
-  int autograder = 0; /* If set, emit summary info for autograder (-g) */
+  int run_libc = 0;    /* If set, print the libc results (set by -l) */
+  int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+  int max_threads = 0; /* If set, measure scaling up to this many threads */
+  size_t max_heap = MAX_HEAP; /* bytes of the memory model (set by -M) */
+  int npipes = 0;             /* If set, replay in this many pipelines (-Q) */
+  int njobs = 1;              /* number of worker processes (set by -j) */
+  int fit_sweep = 0;          /* If set, compare all placement policies (-P) */
+  long arena_window = 0;    /* If set, replay in arenas of this lifetime (-R) */
+  int compare_backings = 0; /* If set, compare the heap backings (-B) */
 
   /* temporaries used to compute the performance index */
   double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
+  double libc_secs, libc_ops, avg_libc_throughput;
   int numcorrect;
 
   /*
    * Read and interpret the command line arguments
    */
-  while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+  while ((c = getopt(argc, argv,
+                     "f:t:hvVgalprLH:s:S:T:Q:R:j:c:C:F:PA:M:uB")) != EOF) {
     switch (c) {
     case 'g': /* Generate summary info for the autograder */
       autograder = 1;
@@ -176,12 +470,78 @@ int main(int argc, char **argv) {
       if (tracedir[strlen(tracedir) - 1] != '/')
         strcat(tracedir, "/"); /* path always ends with "/" */
       break;
+    case 'C': /* Check the mm heap every so many ops */
+      if ((check_every = atol(optarg)) <= 0)
+        app_error("-C needs a positive number of ops");
+      break;
+    case 'c': /* Pin the timing runs to these cores */
+      parse_cpus(optarg);
+      break;
+    case 'F': /* Place blocks with this mm_set_fit policy */
+      if (mm_set_fit(parse_fit(optarg), fit_probes) < 0)
+        app_error("mm_set_fit rejected the -F policy");
+      break;
+    case 'P': /* Run every trace under every placement policy */
+      fit_sweep = 1;
+      break;
+    case 'A': /* Compare these allocators side by side */
+      parse_allocs(optarg);
+      break;
+    case 'M': /* Give the memory model this many MB */
+      if (atol(optarg) <= 0)
+        app_error("-M needs a positive number of MB");
+      max_heap = (size_t)atol(optarg) << 20;
+      mem_set_max_heap(max_heap);
+      break;
+    case 'u': /* Back the heap with huge pages */
+      mem_set_huge_pages(1);
+      break;
+    case 'B': /* Compare the heap on small and on huge pages */
+      compare_backings = 1;
+      break;
+    case 'j': /* Run the traces in this many worker processes */
+      if ((njobs = atoi(optarg)) <= 0)
+        app_error("-j needs a positive number of workers");
+      break;
     case 'a': /* Don't check team structure */
       /* team_check = 0; */
       break;
     case 'l': /* Run libc malloc */
       run_libc = 1;
       break;
+    case 'H': /* Also write the latency distributions to files */
+      latency_file = optarg;
+      latency_report = 1;
+      break;
+    case 'L': /* Report the tail latency of every mm call */
+      latency_report = 1;
+      break;
+    case 'p': /* Count the hardware events of the timed runs */
+      perf_report = 1;
+      break;
+    case 'r': /* Report heap and resident bytes over time */
+      resident_report = 1;
+      break;
+    case 's': /* Sample the mm_stats every so many ops */
+      if ((stats_every = atol(optarg)) <= 0)
+        app_error("-s needs a positive number of ops");
+      break;
+    case 'S': /* Write the mm_stats samples to this file */
+      if ((stats_out = fopen(optarg, "w")) == NULL)
+        unix_error("Could not open the -S file");
+      break;
+    case 'T': /* Replay each trace from 1 to max_threads threads */
+      if ((max_threads = atoi(optarg)) <= 0)
+        app_error("-T needs a positive number of threads");
+      break;
+    case 'Q': /* Replay each trace in npipes producer/consumer pairs */
+      if ((npipes = atoi(optarg)) <= 0)
+        app_error("-Q needs a positive number of pairs");
+      break;
+    case 'R': /* Replay each trace in arenas of this many ops' lifetime */
+      if ((arena_window = atol(optarg)) <= 0)
+        app_error("-R needs a positive number of ops");
+      break;
     case 'v': /* Print per-trace performance breakdown */
       verbose = 1;
       break;
@@ -197,6 +557,32 @@ int main(int argc, char **argv) {
     }
   }
 
+  /* -T and -Q need a package that can be called from several threads */
+#if !MM_THREAD_SAFE
+  if (max_threads > 0)
+    app_error("-T requires a thread-safe build (make mdriver-mt)");
+  if (npipes > 0)
+    app_error("-Q requires a thread-safe build (make mdriver-mt)");
+#endif
+
+  /* mm_stats knows only the heap of the mm package */
+  if (num_compared > 0 && (stats_every > 0 || stats_out != NULL))
+    app_error("-s and -S sample the mm package only, not the -A allocators");
+  if (latency_report)
+    builtins[BUILTIN_MM].lat = latency_hist;
+
+  /* The mm_stats samples go to stdout unless -S names a file */
+  if (stats_every > 0 && stats_out == NULL)
+    stats_out = stdout;
+  if (stats_out != NULL) {
+    fprintf(stats_out, "trace ops heap mapped blocks bytes payload internal "
+                       "free_blocks free_bytes largest external deferred "
+                       "slab_pages");
+    for (i = 0; i < MM_STATS_CLASSES; i++)
+      fprintf(stats_out, " class%d", i);
+    fprintf(stats_out, "\n");
+  }
+
   /*
    * If no -f command line arg, then use the entire set of tracefiles
    * defined in default_traces[]
@@ -207,76 +593,132 @@ int main(int argc, char **argv) {
     printf("Using default tracefiles in %s\n", tracedir);
   }
 
-  /* Initialize the timing package */
-  init_fsecs();
-
   /*
-   * Optionally run and evaluate the libc malloc package
+   * The multi-threaded mode measures scaling instead of computing the
+   * performance index, so it runs on its own and exits
    */
-  if (run_libc) {
-    if (verbose > 1)
-      printf("\nTesting libc malloc\n");
-
-    /* Allocate libc stats array, with one stats_t struct per tracefile */
-    libc_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
-    if (libc_stats == NULL)
-      unix_error("libc_stats calloc in main failed");
+  if (max_threads > 0) {
+    mem_set_max_heap(max_heap * max_threads);
+    mem_init();
+    for (i = 0; i < num_tracefiles; i++) {
+      trace = read_trace(tracedir, tracefiles[i]);
+      eval_mm_scaling(trace, i, max_threads);
+      free_trace(trace);
+    }
+    exit(errors ? 1 : 0);
+  }
 
-    /* Evaluate the libc malloc package using the K-best scheme */
+  /* So does the producer/consumer replay */
+  if (npipes > 0) {
+    mem_set_max_heap(max_heap * npipes);
+    mem_init();
+    printf("\nProducer/consumer replay, %d pairs:\n", npipes);
+    printf("%5s%8s%11s%13s%9s\n", "trace", "frees", "lock Kops",
+           "remote Kops", "speedup");
     for (i = 0; i < num_tracefiles; i++) {
       trace = read_trace(tracedir, tracefiles[i]);
-      libc_stats[i].ops = trace->num_ops;
-      if (verbose > 1)
-        printf("Checking libc malloc for correctness, ");
-      libc_stats[i].valid = eval_libc_valid(trace, i);
-      if (libc_stats[i].valid) {
-        speed_params.trace = trace;
-        if (verbose > 1)
-          printf("and performance.\n");
-        libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
-      }
+      eval_mm_pipeline(trace, i, npipes);
       free_trace(trace);
     }
+    exit(errors ? 1 : 0);
+  }
 
-    /* Display the libc results in a compact table */
-    if (verbose) {
-      printf("\nResults for libc malloc:\n");
-      printresults(num_tracefiles, libc_stats);
+  /* So does the arena replay, which compares arenas with the mm package */
+  if (arena_window > 0) {
+    init_fsecs();
+    mem_init();
+    printf("\nArena replay, lifetimes of %ld ops:\n", arena_window);
+    printf("%5s%8s%8s%7s%9s%9s%9s%9s\n", "trace", "arenas", "resets",
+           "util", "Kops", "mm util", "mm Kops", "speedup");
+    for (i = 0; i < num_tracefiles; i++) {
+      trace = read_trace(tracedir, tracefiles[i]);
+      eval_mm_arena(trace, i, arena_window);
+      free_trace(trace);
     }
+    exit(errors ? 1 : 0);
   }
 
-  /*
-   * Always run and evaluate the student's mm package
-   */
-  if (verbose > 1)
-    printf("\nTesting mm malloc\n");
+  /* Initialize the timing package */
+  init_fsecs();
+
+  /* The comparison of heap backings reports its own results too */
+  if (compare_backings) {
+    eval_backings(tracefiles, num_tracefiles);
+    exit(errors ? 1 : 0);
+  }
 
-  /* Allocate the mm stats array, with one stats_t struct per tracefile */
+  /* Allocate the stats arrays, with one stats_t struct per tracefile */
+  libc_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+  if (libc_stats == NULL)
+    unix_error("libc_stats calloc in main failed");
   mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
   if (mm_stats == NULL)
     unix_error("mm_stats calloc in main failed");
 
+  /*
+   * With -j, worker processes evaluate both packages on every trace. The
+   * latency histograms are kept in this process and the mm_stats samples
+   * are written from it in trace order, so -L and -s run serially.
+   */
+  if (njobs > num_tracefiles || latency_report || stats_out != NULL)
+    njobs = (latency_report || stats_out != NULL) ? 1 : num_tracefiles;
+
+  /* The policy sweep reports its own results instead of a score */
+  if (fit_sweep) {
+    eval_fit_sweep(tracefiles, num_tracefiles, njobs);
+    exit(errors ? 1 : 0);
+  }
+
+  /* So does the comparison of allocators, which runs serially */
+  if (num_compared > 0) {
+    eval_compare(tracefiles, num_tracefiles);
+    exit(errors ? 1 : 0);
+  }
+
+  if (njobs > 1)
+    eval_parallel(tracefiles, num_tracefiles,
+                  (LIBC_BASELINE || run_libc) ? libc_stats : NULL, mm_stats,
+                  njobs);
+
   /* Initialize the simulated memory system in memlib.c */
-  mem_init();
+  if (njobs <= 1)
+    mem_init();
 
-  /* Evaluate student's mm malloc package using the K-best scheme */
-  for (i = 0; i < num_tracefiles; i++) {
-    trace = read_trace(tracedir, tracefiles[i]);
-    mm_stats[i].ops = trace->num_ops;
+  /*
+   * Run libc malloc, whose throughput the score is relative to, unless
+   * the score uses AVG_LIBC_THRUPUT instead
+   */
+  if (njobs <= 1 && (LIBC_BASELINE || run_libc)) {
     if (verbose > 1)
-      printf("Checking mm_malloc for correctness, ");
-    mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-    if (mm_stats[i].valid) {
-      if (verbose > 1)
-        printf("efficiency, ");
-      mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-      speed_params.trace = trace;
-      speed_params.ranges = ranges;
-      if (verbose > 1)
-        printf("and performance.\n");
-      mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-    }
-    free_trace(trace);
+      printf("\nTesting libc malloc\n");
+
+    /* Evaluate the libc malloc package using the K-best scheme */
+    for (i = 0; i < num_tracefiles; i++)
+      eval_mm_trace(&builtins[BUILTIN_LIBC], tracefiles[i], i, &libc_stats[i],
+                    &ranges);
+  }
+
+  /* Display the libc results in a compact table */
+  if (run_libc && verbose) {
+    printf("\nResults for libc malloc:\n");
+    printresults(num_tracefiles, libc_stats);
+  }
+  if (run_libc && perf_report) {
+    printf("\nEvents of libc malloc per 1000 ops:\n");
+    printperf(num_tracefiles, libc_stats);
+  }
+
+  /*
+   * Always run and evaluate the student's mm package
+   */
+  if (njobs <= 1) {
+    if (verbose > 1)
+      printf("\nTesting mm malloc\n");
+
+    /* Evaluate student's mm malloc package using the K-best scheme */
+    for (i = 0; i < num_tracefiles; i++)
+      eval_mm_trace(&builtins[BUILTIN_MM], tracefiles[i], i, &mm_stats[i],
+                    &ranges);
   }
 
   /* Display the mm results in a compact table */
@@ -286,34 +728,59 @@ int main(int argc, char **argv) {
     printf("\n");
   }
 
+  /* Display the hardware events of the mm package */
+  if (perf_report) {
+    printf("\nEvents of mm malloc per 1000 ops:\n");
+    printperf(num_tracefiles, mm_stats);
+    printf("\n");
+  }
+
+  /* Display the latency of the mm calls over all traces */
+  if (latency_report) {
+    printf("\nLatency of mm malloc over all traces:\n");
+    print_latency(latency_hist);
+    printf("\n");
+    if (latency_file != NULL)
+      write_latency(latency_file);
+  }
+
   /*
    * Accumulate the aggregate statistics for the student's mm package
+   * and for libc malloc
    */
   secs = 0;
   ops = 0;
   util = 0;
   numcorrect = 0;
+  libc_secs = 0;
+  libc_ops = 0;
   for (i = 0; i < num_tracefiles; i++) {
     secs += mm_stats[i].secs;
     ops += mm_stats[i].ops;
     util += mm_stats[i].util;
     if (mm_stats[i].valid)
       numcorrect++;
+    libc_secs += libc_stats[i].secs;
+    libc_ops += libc_stats[i].ops;
   }
   avg_mm_util = util / num_tracefiles;
+  avg_libc_throughput =
+      LIBC_BASELINE ? libc_ops / libc_secs : (double)AVG_LIBC_THRUPUT;
 
   /*
-   * Compute and print the performance index
+   * Compute and print the performance index. Throughput counts only up
+   * to that of libc malloc on the same traces, which deters extremely
+   * fast but extremely stupid malloc packages.
    */
   if (errors == 0) {
     avg_mm_throughput = ops / secs;
 
     p1 = UTIL_WEIGHT * avg_mm_util;
-    if (avg_mm_throughput > AVG_LIBC_THRUPUT) {
+    if (avg_mm_throughput > avg_libc_throughput) {
       p2 = (double)(1.0 - UTIL_WEIGHT);
     } else {
       p2 = ((double)(1.0 - UTIL_WEIGHT)) *
-           (avg_mm_throughput / AVG_LIBC_THRUPUT);
+           (avg_mm_throughput / avg_libc_throughput);
     }
 
     perfindex = (p1 + p2) * 100.0;
@@ -334,25 +801,27 @@ int main(int argc, char **argv) {
     printf("perfidx:%.0f\n", perfindex);
   }
 
+  free(libc_stats);
+  free(mm_stats);
   exit(0);
 }
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range tree, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks in O(log n).
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range struct for this block and add it to the range tree.
  */
 static int add_range(range_t **ranges, char *lo, int size, int tracenum,
-                     int opnum) {
+                     long opnum) {
   char *hi = lo + size - 1;
-  range_t *p;
+  range_t *p, *q, *l, *r;
   char msg[MAXLINE];
 
   assert(size > 0);
@@ -364,35 +833,59 @@ static int add_range(range_t **ranges, char *lo, int size, int tracenum,
     return 0;
   }
 
-  /* The payload must lie within the extent of the heap */
-  if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-      (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+  /* The payload must lie within the extent of the heap or of a mapping */
+  if (alloc->heap &&
+      ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+       (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+      !mem_is_mapped(lo, hi)) {
     sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)", lo, hi,
             mem_heap_lo(), mem_heap_hi());
     malloc_error(tracenum, opnum, msg);
     return 0;
   }
 
-  /* The payload must not overlap any other payloads */
-  for (p = *ranges; p != NULL; p = p->next) {
-    if ((lo >= p->lo && lo <= p->hi) || (hi >= p->lo && hi <= p->hi)) {
-      sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n", lo, hi,
-              p->lo, p->hi);
-      malloc_error(tracenum, opnum, msg);
-      return 0;
+  /*
+   * The payload must not overlap any other payloads. The recorded
+   * payloads are disjoint, so only the last one starting at or below
+   * hi can reach into this one.
+   */
+  for (p = *ranges, q = NULL; p != NULL;)
+    if (p->lo <= hi) {
+      q = p;
+      p = p->right;
+    } else {
+      p = p->left;
     }
+  if (q != NULL && q->hi >= lo) {
+    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n", lo, hi,
+            q->lo, q->hi);
+    malloc_error(tracenum, opnum, msg);
+    return 0;
   }
 
   /*
    * Everything looks OK, so remember the extent of this block
-   * by creating a range struct and adding it the range list.
+   * by taking a range struct from the pool and adding it the range tree.
    */
-  if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-    unix_error("malloc error in add_range");
-  p->next = *ranges;
+  if (range_pool == NULL) {
+    if ((p = (range_t *)malloc(RANGE_CHUNK * sizeof(range_t))) == NULL)
+      unix_error("malloc error in add_range");
+    for (q = p; q < p + RANGE_CHUNK; q++)
+      q->left = (q + 1 < p + RANGE_CHUNK) ? q + 1 : NULL;
+    range_pool = p;
+  }
+  p = range_pool;
+  range_pool = p->left;
   p->lo = lo;
   p->hi = hi;
-  *ranges = p;
+  range_seed ^= range_seed << 13;
+  range_seed ^= range_seed >> 17;
+  range_seed ^= range_seed << 5;
+  p->prio = range_seed;
+  p->left = p->right = NULL;
+
+  split_ranges(*ranges, lo, &l, &r);
+  *ranges = merge_ranges(merge_ranges(l, p), r);
   return 1;
 }
 
@@ -401,32 +894,62 @@ static int add_range(range_t **ranges, char *lo, int size, int tracenum,
  */
 static void remove_range(range_t **ranges, char *lo) {
   range_t *p;
-  range_t **prevpp = ranges;
-  /* int size; */
 
-  for (p = *ranges; p != NULL; p = p->next) {
-    if (p->lo == lo) {
-      *prevpp = p->next;
-      /* size = p->hi - p->lo + 1; */
-      free(p);
-      break;
-    }
-    prevpp = &(p->next);
+  while ((p = *ranges) != NULL && p->lo != lo)
+    ranges = (lo < p->lo) ? &p->left : &p->right;
+  if (p != NULL) {
+    *ranges = merge_ranges(p->left, p->right);
+    p->left = range_pool;
+    range_pool = p;
   }
 }
 
 /*
- * clear_ranges - free all of the range records for a trace
+ * clear_ranges - return all of the range records for a trace to the pool
  */
 static void clear_ranges(range_t **ranges) {
-  range_t *p;
-  range_t *pnext;
+  range_t *p = *ranges;
+
+  if (p == NULL)
+    return;
+  clear_ranges(&p->left);
+  clear_ranges(&p->right);
+  p->left = range_pool;
+  range_pool = p;
+  *ranges = NULL;
+}
 
-  for (p = *ranges; p != NULL; p = pnext) {
-    pnext = p->next;
-    free(p);
+/*
+ * merge_ranges - join two range trees where every payload in l lies
+ *     below every payload in r
+ */
+static range_t *merge_ranges(range_t *l, range_t *r) {
+  if (l == NULL)
+    return r;
+  if (r == NULL)
+    return l;
+  if (l->prio > r->prio) {
+    l->right = merge_ranges(l->right, r);
+    return l;
+  }
+  r->left = merge_ranges(l, r->left);
+  return r;
+}
+
+/*
+ * split_ranges - split a range tree into the payloads below lo (*l) and
+ *     the ones at or above it (*r)
+ */
+static void split_ranges(range_t *t, char *lo, range_t **l, range_t **r) {
+  if (t == NULL) {
+    *l = *r = NULL;
+  } else if (t->lo < lo) {
+    split_ranges(t->right, lo, &t->right, r);
+    *l = t;
+  } else {
+    split_ranges(t->left, lo, l, &t->left);
+    *r = t;
   }
-  *ranges = NULL;
 }
 
 /**********************************************
@@ -434,56 +957,96 @@ static void clear_ranges(range_t **ranges) {
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * open_trace - open a trace file, or for "-" a copy of the standard input
+ *     that is spooled into a temporary file the first time, so a piped
+ *     trace can be mapped and read again for every package
  */
-static trace_t *read_trace(char *tracedir, char *filename) {
+static FILE *open_trace(char *path) {
   FILE *tracefile;
-  trace_t *trace;
-  char type[MAXLINE];
-  char path[MAXLINE];
-  unsigned index, size;
-  unsigned max_index = 0;
-  unsigned op_index;
+  char buf[BUFSIZ];
+  size_t n;
 
-  if (verbose > 1)
-    printf("Reading tracefile: %s\n", filename);
+  if (strcmp(path, "-") != 0) {
+    if ((tracefile = fopen(path, "r")) == NULL) {
+      sprintf(msg, "Could not open %s in read_trace", path);
+      unix_error(msg);
+    }
+    return tracefile;
+  }
 
-  /* Allocate the trace record */
-  if ((trace = (trace_t *)malloc(sizeof(trace_t))) == NULL)
-    unix_error("malloc 1 failed in read_trance");
+  if (stdin_trace == NULL) {
+    if ((stdin_trace = tmpfile()) == NULL)
+      unix_error("tmpfile failed in open_trace");
+    while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+      if (fwrite(buf, 1, n, stdin_trace) != n)
+        unix_error("Could not spool the standard input in open_trace");
+    if (fflush(stdin_trace) != 0)
+      unix_error("Could not spool the standard input in open_trace");
+  }
+  rewind(stdin_trace);
+  return stdin_trace;
+}
 
-  /* Read the trace file header */
-  strcpy(path, tracedir);
-  strcat(path, filename);
-  if ((tracefile = fopen(path, "r")) == NULL) {
-    sprintf(msg, "Could not open %s in read_trace", path);
-    unix_error(msg);
+/*
+ * map_trace - map the requests of the binary trace whose header we have
+ *     just read, so that they are replayed right out of the page cache
+ */
+static void map_trace(trace_t *trace, FILE *tracefile, tracehdr_t *hdr,
+                      char *path) {
+  struct stat st;
+  uint64_t len = sizeof(tracehdr_t) + hdr->num_ops * sizeof(traceop_t);
+
+  if (fstat(fileno(tracefile), &st) < 0)
+    unix_error("fstat failed in map_trace");
+  if ((uint64_t)st.st_size < len || len > SIZE_MAX ||
+      hdr->num_ops > LONG_MAX || hdr->num_ids > TRACE_MAX_ID + 1ull) {
+    sprintf(msg, "Binary trace %s is truncated or too large", path);
+    app_error(msg);
   }
+
+  trace->sugg_heapsize = hdr->sugg_heapsize;
+  trace->num_ids = hdr->num_ids;
+  trace->num_ops = hdr->num_ops;
+  trace->weight = hdr->weight;
+  trace->map_len = len;
+  trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE,
+                    fileno(tracefile), 0);
+  if (trace->map == MAP_FAILED)
+    unix_error("mmap failed in map_trace");
+  madvise(trace->map, trace->map_len, MADV_SEQUENTIAL);
+  trace->ops = (traceop_t *)((char *)trace->map + sizeof(tracehdr_t));
+}
+
+/*
+ * parse_trace - read the header and every request line of a text trace
+ */
+static void parse_trace(trace_t *trace, FILE *tracefile, char *path) {
+  char type[MAXLINE];
+  unsigned index, size, align;
+  unsigned max_index = 0;
+  long op_index;
+
   fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-  fscanf(tracefile, "%d", &(trace->num_ids));
-  fscanf(tracefile, "%d", &(trace->num_ops));
+  fscanf(tracefile, "%ld", &(trace->num_ids));
+  fscanf(tracefile, "%ld", &(trace->num_ops));
   fscanf(tracefile, "%d", &(trace->weight)); /* not used */
+  if (trace->num_ids < 0 || trace->num_ops < 0) {
+    sprintf(msg, "Text trace %s has a bad header", path);
+    app_error(msg);
+  }
+  trace->map = NULL;
+  trace->map_len = 0;
 
   /* We'll store each request line in the trace in this array */
   if ((trace->ops = (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) ==
       NULL)
     unix_error("malloc 2 failed in read_trace");
 
-  /* We'll keep an array of pointers to the allocated blocks here... */
-  if ((trace->blocks = (char **)malloc(trace->num_ids * sizeof(char *))) ==
-      NULL)
-    unix_error("malloc 3 failed in read_trace");
-
-  /* ... along with the corresponding byte sizes of each block */
-  if ((trace->block_sizes =
-           (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
-    unix_error("malloc 4 failed in read_trace");
-
   /* read every request line in the trace file */
   index = 0;
   op_index = 0;
   while (fscanf(tracefile, "%s", type) != EOF) {
-    // printf("%d\n", op_index);
+    trace->ops[op_index].lg_align = 0;
     switch (type[0]) {
     case 'a':
       fscanf(tracefile, "%u %u", &index, &size);
@@ -492,6 +1055,26 @@ static trace_t *read_trace(char *tracedir, char *filename) {
       trace->ops[op_index].size = size;
       max_index = (index > max_index) ? index : max_index;
       break;
+    case 'c':
+      fscanf(tracefile, "%u %u", &index, &size);
+      trace->ops[op_index].type = CALLOC;
+      trace->ops[op_index].index = index;
+      trace->ops[op_index].size = size;
+      max_index = (index > max_index) ? index : max_index;
+      break;
+    case 'm':
+      fscanf(tracefile, "%u %u %u", &index, &align, &size);
+      if (align == 0 || (align & (align - 1)) != 0) {
+        printf("Alignment %u is not a power of two in tracefile %s\n", align,
+               path);
+        exit(1);
+      }
+      trace->ops[op_index].type = MEMALIGN;
+      trace->ops[op_index].lg_align = __builtin_ctz(align);
+      trace->ops[op_index].index = index;
+      trace->ops[op_index].size = size;
+      max_index = (index > max_index) ? index : max_index;
+      break;
     case 'r':
       fscanf(tracefile, "%u %u", &index, &size);
       trace->ops[op_index].type = REALLOC;
@@ -510,19 +1093,72 @@ static trace_t *read_trace(char *tracedir, char *filename) {
     }
     op_index++;
   }
-  fclose(tracefile);
-  assert((int)max_index == trace->num_ids - 1);
-  assert(trace->num_ops == (int)op_index);
+  assert((long)max_index == trace->num_ids - 1);
+  assert(trace->num_ops == op_index);
+}
+
+/*
+ * read_trace - read a trace file and store it in memory. Binary traces
+ *     (see trace.h and rep2bin) are mapped instead of parsed.
+ */
+static trace_t *read_trace(char *tracedir, char *filename) {
+  FILE *tracefile;
+  trace_t *trace;
+  tracehdr_t hdr;
+  char path[MAXLINE];
+
+  if (verbose > 1)
+    printf("Reading tracefile: %s\n", filename);
+
+  /* Allocate the trace record */
+  if ((trace = (trace_t *)malloc(sizeof(trace_t))) == NULL)
+    unix_error("malloc 1 failed in read_trance");
+
+  /* Read the trace file header */
+  if (strcmp(filename, "-") == 0) {
+    strcpy(path, filename);
+  } else {
+    strcpy(path, tracedir);
+    strcat(path, filename);
+  }
+  tracefile = open_trace(path);
+  if (fread(&hdr, sizeof(hdr), 1, tracefile) == 1 &&
+      memcmp(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN - 1) == 0) {
+    if (memcmp(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+      sprintf(msg, "Binary trace %s has an older format, convert it again",
+              path);
+      app_error(msg);
+    }
+    map_trace(trace, tracefile, &hdr, path);
+  } else {
+    rewind(tracefile);
+    parse_trace(trace, tracefile, path);
+  }
+  if (tracefile != stdin_trace)
+    fclose(tracefile);
+
+  /* We'll keep an array of pointers to the allocated blocks here... */
+  if ((trace->blocks = (char **)malloc(trace->num_ids * sizeof(char *))) ==
+      NULL)
+    unix_error("malloc 3 failed in read_trace");
+
+  /* ... along with the corresponding byte sizes of each block */
+  if ((trace->block_sizes =
+           (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+    unix_error("malloc 4 failed in read_trace");
 
   return trace;
 }
 
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated (or mapped) in read_trace().
  */
 void free_trace(trace_t *trace) {
-  free(trace->ops); /* free the three arrays... */
+  if (trace->map_len > 0) /* free the three arrays... */
+    munmap(trace->map, trace->map_len);
+  else
+    free(trace->ops);
   free(trace->blocks);
   free(trace->block_sizes);
   free(trace); /* and the trace record itself... */
@@ -534,10 +1170,11 @@ void free_trace(trace_t *trace) {
  **********************************************************************/
 
 /*
- * eval_mm_valid - Check the mm malloc package for correctness
+ * eval_mm_valid - Check the allocator for correctness
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
-  int i, j;
+  long i;
+  int j;
   int index;
   int size;
   int oldsize;
@@ -545,12 +1182,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
   char *oldp;
   char *p;
 
-  /* Reset the heap and free any records in the range list */
+  /* Reset the heap and free any records in the range tree */
   mem_reset_brk();
   clear_ranges(ranges);
 
-  /* Call the mm package's init function */
-  if (mm_init() < 0) {
+  /* Call the allocator's init function */
+  if (alloc->init() < 0) {
     malloc_error(tracenum, 0, "mm_init failed.");
     return 0;
   }
@@ -562,22 +1199,42 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
 
     switch (trace->ops[i].type) {
 
-    case ALLOC: /* mm_malloc */
+    case ALLOC:    /* mm_malloc */
+    case CALLOC:   /* mm_calloc */
+    case MEMALIGN: /* mm_memalign */
 
-      /* Call the student's malloc */
-      if ((p = mm_malloc(size)) == NULL) {
-        malloc_error(tracenum, i, "mm_malloc failed.");
+      /* Call the student's malloc, calloc or memalign */
+      if (trace->ops[i].type == MEMALIGN && alloc->memalign == NULL) {
+        malloc_error(tracenum, i, "the allocator has no memalign.");
+        return 0;
+      }
+      if ((p = new_block(&trace->ops[i])) == NULL) {
+        sprintf(msg, "mm_%s failed.", call_names[trace->ops[i].type]);
+        malloc_error(tracenum, i, msg);
         return 0;
       }
 
       /*
        * Test the range of the new block for correctness and add it
-       * to the range list if OK. The block must be  be aligned properly,
+       * to the range tree if OK. The block must be  be aligned properly,
        * and must not overlap any currently allocated block.
        */
       if (add_range(ranges, p, size, tracenum, i) == 0)
         return 0;
 
+      /* calloc must zero the block, memalign must align it as asked */
+      if (trace->ops[i].type == CALLOC)
+        for (j = 0; j < size; j++)
+          if (p[j] != 0) {
+            malloc_error(tracenum, i, "mm_calloc did not zero the block");
+            return 0;
+          }
+      if (trace->ops[i].type == MEMALIGN &&
+          ((uintptr_t)p & (TRACE_ALIGN(&trace->ops[i]) - 1)) != 0) {
+        malloc_error(tracenum, i, "mm_memalign did not align the block");
+        return 0;
+      }
+
       /* ADDED: cgw
        * fill range with low byte of index.  This will be used later
        * if we realloc the block and wish to make sure that the old
@@ -594,15 +1251,15 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
 
       /* Call the student's realloc */
       oldp = trace->blocks[index];
-      if ((newp = mm_realloc(oldp, size)) == NULL) {
+      if ((newp = alloc->realloc(oldp, size)) == NULL) {
         malloc_error(tracenum, i, "mm_realloc failed.");
         return 0;
       }
 
-      /* Remove the old region from the range list */
+      /* Remove the old region from the range tree */
       remove_range(ranges, oldp);
 
-      /* Check new block for correctness and add it to range list */
+      /* Check new block for correctness and add it to range tree */
       if (add_range(ranges, newp, size, tracenum, i) == 0)
         return 0;
 
@@ -615,7 +1272,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
       if (size < oldsize)
         oldsize = size;
       for (j = 0; j < oldsize; j++) {
-        if (newp[j] != (index & 0xFF)) {
+        if ((unsigned char)newp[j] != (index & 0xFF)) {
           malloc_error(tracenum, i,
                        "mm_realloc did not preserve the "
                        "data from old block");
@@ -634,13 +1291,21 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
       /* Remove region from list and call student's free function */
       p = trace->blocks[index];
       remove_range(ranges, p);
-      mm_free(p);
+      alloc->free(p);
       break;
 
     default:
       app_error("Nonexistent request type in eval_mm_valid");
     }
+
+    /* mm_check knows only the heap of the mm package */
+    if (check_every && alloc == &builtins[BUILTIN_MM] &&
+        (i + 1) % check_every == 0 && mm_check() < 0) {
+      malloc_error(tracenum, i, "mm_check found the heap inconsistent");
+      return 0;
+    }
   }
+  free_live(trace);
 
   /* As far as we know, this is a valid malloc package */
   return 1;
@@ -650,35 +1315,59 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   Utilization is the ratio hwm/peaksize, where peaksize is the
+ *   most memory the package held at once while running the trace:
+ *   the heap plus any blocks it mapped with mem_map().
  *
+ *   With -r, it also prints the memory in use and the bytes actually
+ *   resident every num_ops/RESIDENT_SAMPLES operations, then the peaks.
+ *   With -s or -S, it writes a sample of the mm_stats every stats_every
+ *   operations (by default num_ops/RESIDENT_SAMPLES) and after the last.
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
-  int i;
+  long i;
   int index;
   int size, newsize, oldsize;
   int max_total_size = 0;
   int total_size = 0;
   char *p;
   char *newp, *oldp;
+  long sample_every = 0;
+  long stats_period = 0;
+  size_t resident, peak_resident = 0;
+
+  /* start the report from a heap with no pages resident */
+  if (resident_report) {
+    mem_discard(mem_heap_lo(), mem_heapsize());
+    sample_every = trace->num_ops / RESIDENT_SAMPLES;
+    if (sample_every == 0)
+      sample_every = 1;
+    printf("\nMemory of %s malloc on trace %d:\n", alloc->name, tracenum);
+    printf("%9s %10s %10s\n", "ops", "bytes", "resident");
+  }
+
+  if (stats_out != NULL) {
+    stats_period = stats_every ? stats_every
+                               : trace->num_ops / RESIDENT_SAMPLES;
+    if (stats_period == 0)
+      stats_period = 1;
+  }
 
   /* initialize the heap and the mm malloc package */
   mem_reset_brk();
-  if (mm_init() < 0)
+  if (alloc->init() < 0)
     app_error("mm_init failed in eval_mm_util");
 
   for (i = 0; i < trace->num_ops; i++) {
     switch (trace->ops[i].type) {
 
-    case ALLOC: /* mm_alloc */
+    case ALLOC:    /* mm_alloc */
+    case CALLOC:   /* mm_calloc */
+    case MEMALIGN: /* mm_memalign */
       index = trace->ops[i].index;
       size = trace->ops[i].size;
 
-      if ((p = mm_malloc(size)) == NULL)
+      if ((p = new_block(&trace->ops[i])) == NULL)
         app_error("mm_malloc failed in eval_mm_util");
 
       /* Remember region and size */
@@ -700,7 +1389,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
       oldsize = trace->block_sizes[index];
 
       oldp = trace->blocks[index];
-      if ((newp = mm_realloc(oldp, newsize)) == NULL)
+      if ((newp = alloc->realloc(oldp, newsize)) == NULL)
         app_error("mm_realloc failed in eval_mm_util");
 
       /* Remember region and size */
@@ -721,7 +1410,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
       size = trace->block_sizes[index];
       p = trace->blocks[index];
 
-      mm_free(p);
+      alloc->free(p);
 
       /* Keep track of current total size
        * of all allocated blocks */
@@ -732,23 +1421,72 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
     default:
       app_error("Nonexistent request type in eval_mm_util");
     }
-  }
 
-  return ((double)max_total_size / (double)mem_heapsize());
-}
+    if (sample_every && ((i + 1) % sample_every == 0 ||
+                         i + 1 == trace->num_ops)) {
+      resident = mem_resident();
+      if (resident > peak_resident)
+        peak_resident = resident;
+      printf("%9ld %10lu %10lu\n", i + 1,
+             (unsigned long)(mem_heapsize() + mem_mapsize()),
+             (unsigned long)resident);
+    }
+
+    if (stats_period && ((i + 1) % stats_period == 0 ||
+                         i + 1 == trace->num_ops))
+      sample_stats(tracenum, i + 1, total_size);
+  }
+
+  if (resident_report)
+    printf("%9s %10lu %10lu\n", "peak", (unsigned long)mem_peaksize(),
+           (unsigned long)peak_resident);
+
+  return ((double)max_total_size / (double)mem_peaksize());
+}
+
+/*
+ * sample_stats - Write one row of the -s/-S time series: the mm_stats
+ *     of the heap after the first ops requests of trace tracenum, when
+ *     the trace holds payload bytes. Internal fragmentation is the part
+ *     of the bytes in use (heap blocks, minus free slab slots, plus
+ *     mapped blocks) that is not payload.
+ */
+static void sample_stats(int tracenum, long ops, int payload) {
+  mm_stats_t st;
+  size_t in_use;
+  double internal = 0;
+  int i;
+
+  mm_stats(&st);
+  in_use = st.alloc_bytes - st.slab_free + st.mapped_bytes;
+  if (in_use > 0)
+    internal = 1.0 - (double)payload / in_use;
+
+  fprintf(stats_out, "%d %ld %lu %lu %lu %lu %d %.4f %lu %lu %lu %.4f %lu %lu",
+          tracenum, ops, (unsigned long)st.heap_bytes,
+          (unsigned long)st.mapped_bytes, (unsigned long)st.alloc_blocks,
+          (unsigned long)st.alloc_bytes, payload, internal,
+          (unsigned long)st.free_blocks, (unsigned long)st.free_bytes,
+          (unsigned long)st.largest_free, st.external_frag,
+          (unsigned long)st.deferred_blocks, (unsigned long)st.slab_pages);
+  for (i = 0; i < MM_STATS_CLASSES; i++)
+    fprintf(stats_out, " %lu", (unsigned long)st.class_blocks[i]);
+  fprintf(stats_out, "\n");
+}
 
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ *    to measure the running time of the allocator.
  */
 static void eval_mm_speed(void *ptr) {
-  int i, index, size, newsize;
+  long i;
+  int index, size, newsize;
   char *p, *newp, *oldp, *block;
   trace_t *trace = ((speed_t *)ptr)->trace;
 
-  /* Reset the heap and initialize the mm package */
+  /* Reset the heap and initialize the allocator */
   mem_reset_brk();
-  if (mm_init() < 0)
+  if (alloc->init() < 0)
     app_error("mm_init failed in eval_mm_speed");
 
   /* Interpret each trace request */
@@ -758,16 +1496,24 @@ static void eval_mm_speed(void *ptr) {
     case ALLOC: /* mm_malloc */
       index = trace->ops[i].index;
       size = trace->ops[i].size;
-      if ((p = mm_malloc(size)) == NULL)
+      if ((p = alloc->malloc(size)) == NULL)
         app_error("mm_malloc error in eval_mm_speed");
       trace->blocks[index] = p;
       break;
 
+    case CALLOC:   /* mm_calloc */
+    case MEMALIGN: /* mm_memalign */
+      index = trace->ops[i].index;
+      if ((p = new_block(&trace->ops[i])) == NULL)
+        app_error("mm_calloc or mm_memalign error in eval_mm_speed");
+      trace->blocks[index] = p;
+      break;
+
     case REALLOC: /* mm_realloc */
       index = trace->ops[i].index;
       newsize = trace->ops[i].size;
       oldp = trace->blocks[index];
-      if ((newp = mm_realloc(oldp, newsize)) == NULL)
+      if ((newp = alloc->realloc(oldp, newsize)) == NULL)
         app_error("mm_realloc error in eval_mm_speed");
       trace->blocks[index] = newp;
       break;
@@ -775,94 +1521,1086 @@ static void eval_mm_speed(void *ptr) {
     case FREE: /* mm_free */
       index = trace->ops[i].index;
       block = trace->blocks[index];
-      mm_free(block);
+      alloc->free(block);
       break;
 
     default:
       app_error("Nonexistent request type in eval_mm_valid");
     }
+  free_live(trace);
 }
 
 /*
- * eval_libc_valid - We run this function to make sure that the
- *    libc malloc can run to completion on the set of traces.
- *    We'll be conservative and terminate if any libc malloc call fails.
- *
+ * free_live - Free the blocks a run of the trace leaves in use. An
+ *    allocator on the memory model gets them back from mem_reset_brk;
+ *    one that is not, like libc malloc, would leak them.
  */
-static int eval_libc_valid(trace_t *trace, int tracenum) {
-  int i, newsize;
-  char *p, *newp, *oldp;
+static void free_live(trace_t *trace) {
+  char *live;
+  long i;
+
+  if (alloc->heap)
+    return;
+  if ((live = calloc(trace->num_ids, 1)) == NULL)
+    unix_error("calloc failed in free_live");
+  for (i = 0; i < trace->num_ops; i++)
+    live[trace->ops[i].index] = (trace->ops[i].type != FREE);
+  for (i = 0; i < trace->num_ids; i++)
+    if (live[i])
+      alloc->free(trace->blocks[i]);
+  free(live);
+}
+
+/*
+ * eval_mm_latency - Replay the trace once more, reading the cycle counter
+ *    around every call, and with -L print the percentiles of each type of
+ *    call. The histograms are then added to those of the allocator.
+ */
+static void eval_mm_latency(trace_t *trace, int tracenum) {
+  unsigned long long (*hist)[LAT_BUCKETS];
+  unsigned long long start, cycles, overhead = ~0ULL;
+  long i;
+  int t, b, index;
+  char *p;
+
+  if ((hist = calloc(LAT_TYPES, sizeof(*hist))) == NULL)
+    unix_error("calloc failed in eval_mm_latency");
+
+  /* What two back-to-back counter reads cost is not the call's */
+  for (i = 0; i < 1000; i++) {
+    start = read_counter();
+    cycles = read_counter() - start;
+    overhead = (cycles < overhead) ? cycles : overhead;
+  }
+
+  mem_reset_brk();
+  if (alloc->init() < 0)
+    app_error("mm_init failed in eval_mm_latency");
 
   for (i = 0; i < trace->num_ops; i++) {
+    index = trace->ops[i].index;
     switch (trace->ops[i].type) {
+    case ALLOC:    /* mm_malloc */
+    case CALLOC:   /* mm_calloc */
+    case MEMALIGN: /* mm_memalign */
+      start = read_counter();
+      p = new_block(&trace->ops[i]);
+      cycles = read_counter() - start;
+      if (p == NULL)
+        app_error("mm_malloc error in eval_mm_latency");
+      trace->blocks[index] = p;
+      break;
+
+    case REALLOC: /* mm_realloc */
+      start = read_counter();
+      p = alloc->realloc(trace->blocks[index], trace->ops[i].size);
+      cycles = read_counter() - start;
+      if (p == NULL)
+        app_error("mm_realloc error in eval_mm_latency");
+      trace->blocks[index] = p;
+      break;
+
+    default: /* mm_free */
+      start = read_counter();
+      alloc->free(trace->blocks[index]);
+      cycles = read_counter() - start;
+      break;
+    }
+    cycles = (cycles > overhead) ? cycles - overhead : 0;
+    hist[trace->ops[i].type][lat_bucket(cycles)]++;
+  }
+  free_live(trace);
+
+  if (latency_report) {
+    printf("\nLatency of %s malloc on trace %d:\n", alloc->name, tracenum);
+    print_latency(hist);
+  }
+  for (t = 0; t < LAT_TYPES; t++)
+    for (b = 0; b < LAT_BUCKETS; b++)
+      alloc->lat[t][b] += hist[t][b];
+  free(hist);
+}
 
-    case ALLOC: /* malloc */
-      if ((p = malloc(trace->ops[i].size)) == NULL) {
-        malloc_error(tracenum, i, "libc malloc failed");
-        unix_error("System message");
+/*
+ * lat_bucket - Return the histogram bucket that holds a cycle count
+ */
+static unsigned lat_bucket(unsigned long long cycles) {
+  int shift;
+
+  if (cycles < LAT_SUB)
+    return cycles;
+  shift = 63 - __builtin_clzll(cycles) - LAT_SUB_BITS;
+  return (shift + 1) * LAT_SUB + ((cycles >> shift) & (LAT_SUB - 1));
+}
+
+/*
+ * lat_value - Return the largest cycle count that falls into a bucket
+ */
+static unsigned long long lat_value(unsigned bucket) {
+  int shift = bucket / LAT_SUB - 1;
+
+  if (shift < 0)
+    return bucket;
+  return ((unsigned long long)(LAT_SUB + bucket % LAT_SUB + 1) << shift) - 1;
+}
+
+/*
+ * lat_percentile - Return the smallest bucket value that at least pct
+ *    percent of the recorded calls do not exceed
+ */
+static unsigned long long lat_percentile(unsigned long long *hist,
+                                         double pct) {
+  unsigned long long total = 0, seen = 0;
+  unsigned b;
+
+  for (b = 0; b < LAT_BUCKETS; b++)
+    total += hist[b];
+  for (b = 0; b < LAT_BUCKETS; b++)
+    if ((seen += hist[b]) > 0 && seen >= pct / 100 * total)
+      return lat_value(b);
+  return 0;
+}
+
+/*
+ * print_latency - Print the median, tail and maximum latency (in
+ *    nanoseconds) of each type of mm call in a compact table
+ */
+static void print_latency(unsigned long long (*hist)[LAT_BUCKETS]) {
+  unsigned long long count;
+  double ns = 1e3 / fsecs_mhz();
+  int t, b;
+
+  printf("%-8s%10s%10s%10s%10s%10s\n", "op", "count", "p50(ns)", "p99(ns)",
+         "p99.9(ns)", "max(ns)");
+  for (t = 0; t < LAT_TYPES; t++) {
+    for (b = count = 0; b < LAT_BUCKETS; b++)
+      count += hist[t][b];
+    if (count == 0)
+      continue;
+    printf("%-8s%10llu%10.0f%10.0f%10.0f%10.0f\n", call_names[t], count,
+           lat_percentile(hist[t], 50) * ns, lat_percentile(hist[t], 99) * ns,
+           lat_percentile(hist[t], 99.9) * ns,
+           lat_percentile(hist[t], 100) * ns);
+  }
+}
+
+/*
+ * write_latency - Write the latency of each type of mm call over all
+ *    traces to <prefix>.<call>.hgrm, as a percentile distribution in
+ *    microseconds laid out like HdrHistogram's, so that its plotting
+ *    tools can read it
+ */
+static void write_latency(char *prefix) {
+  unsigned long long *hist, count, seen;
+  double us = 1 / fsecs_mhz(), pct, next, mean, var, v;
+  char path[MAXLINE];
+  FILE *fp;
+  int t, b, tick;
+
+  for (t = 0; t < LAT_TYPES; t++) {
+    hist = latency_hist[t];
+    count = 0;
+    mean = var = 0;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+      count += hist[b];
+      mean += hist[b] * (double)lat_value(b);
+    }
+    if (count == 0)
+      continue;
+    mean /= count;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+      v = lat_value(b) - mean;
+      var += hist[b] * v * v;
+    }
+
+    sprintf(path, "%.1000s.%s.hgrm", prefix, call_names[t]);
+    if ((fp = fopen(path, "w")) == NULL) {
+      sprintf(msg, "Could not create %s", path);
+      unix_error(msg);
+    }
+    fprintf(fp, "%12s %14s %10s %14s\n\n", "Value", "Percentile",
+            "TotalCount", "1/(1-Percentile)");
+
+    /* Five lines for every halving of the distance to 100% */
+    seen = 0;
+    tick = 0;
+    next = 0;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+      if (hist[b] == 0)
+        continue;
+      seen += hist[b];
+      pct = (double)seen / count;
+      if (pct < next && seen < count)
+        continue;
+      if (seen == count) {
+        fprintf(fp, "%12.3f %2.12f %10llu\n", lat_value(b) * us, pct, seen);
+        break;
       }
-      trace->blocks[trace->ops[i].index] = p;
+      fprintf(fp, "%12.3f %2.12f %10llu %14.2f\n", lat_value(b) * us, pct,
+              seen, 1 / (1 - pct));
+      while (next <= pct)
+        next = 1 - pow(0.5, ++tick / 5.0);
+    }
+    fprintf(fp, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean * us,
+            sqrt(var / count) * us);
+    fprintf(fp, "#[Max     = %12.3f, Total count    = %12llu]\n",
+            lat_percentile(hist, 100) * us, count);
+    fprintf(fp, "#[Buckets = %12d, SubBuckets     = %12d]\n", LAT_BUCKETS,
+            LAT_SUB);
+    fclose(fp);
+  }
+}
+
+#if MM_THREAD_SAFE
+/*
+ * replay_thread - Run one thread's copy of the trace. In check mode every
+ *    block is filled with a pattern unique to this thread and id, and
+ *    verified before it is realloc'ed or freed, which catches blocks
+ *    handed out to two threads at once. With -Q the blocks are handed to
+ *    the consumer instead of freed.
+ */
+static void *replay_thread(void *arg) {
+  replay_t *r = (replay_t *)arg;
+  trace_t *trace = r->trace;
+  long i;
+  int j, index, size, oldsize;
+  char *p, *newp;
+  char fill;
+
+  for (i = 0; i < trace->num_ops; i++) {
+    index = trace->ops[i].index;
+    size = trace->ops[i].size;
+    fill = (char)(r->tid * 31 + index);
+
+    switch (trace->ops[i].type) {
+
+    case ALLOC:    /* mm_malloc */
+    case CALLOC:   /* mm_calloc */
+    case MEMALIGN: /* mm_memalign */
+      if (trace->ops[i].type == CALLOC)
+        p = mm_calloc(1, size);
+      else if (trace->ops[i].type == MEMALIGN)
+        p = mm_memalign(TRACE_ALIGN(&trace->ops[i]), size);
+      else
+        p = mm_malloc(size);
+      if (p == NULL) {
+        r->full = 1;
+        return NULL;
+      }
+      if (r->check && trace->ops[i].type == CALLOC)
+        for (j = 0; j < size; j++)
+          if (p[j] != 0) {
+            r->errors++;
+            break;
+          }
+      if (r->check)
+        memset(p, fill, size);
+      r->blocks[index] = p;
+      r->block_sizes[index] = size;
       break;
 
-    case REALLOC: /* realloc */
-      newsize = trace->ops[i].size;
-      oldp = trace->blocks[trace->ops[i].index];
-      if ((newp = realloc(oldp, newsize)) == NULL) {
-        malloc_error(tracenum, i, "libc realloc failed");
-        unix_error("System message");
+    case REALLOC: /* mm_realloc */
+      p = r->blocks[index];
+      oldsize = r->block_sizes[index];
+      if (r->check)
+        for (j = 0; j < oldsize; j++)
+          if (p[j] != fill) {
+            r->errors++;
+            break;
+          }
+      if ((newp = mm_realloc(p, size)) == NULL) {
+        r->full = 1;
+        return NULL;
+      }
+      if (r->check) {
+        if (size < oldsize)
+          oldsize = size;
+        for (j = 0; j < oldsize; j++)
+          if (newp[j] != fill) {
+            r->errors++;
+            break;
+          }
+        memset(newp, fill, size);
       }
-      trace->blocks[trace->ops[i].index] = newp;
+      r->blocks[index] = newp;
+      r->block_sizes[index] = size;
       break;
 
-    case FREE: /* free */
-      free(trace->blocks[trace->ops[i].index]);
+    case FREE: /* mm_free */
+      p = r->blocks[index];
+      if (r->check)
+        for (j = 0; j < (int)r->block_sizes[index]; j++)
+          if (p[j] != fill) {
+            r->errors++;
+            break;
+          }
+      if (r->pipe != NULL)
+        pipe_handoff(r->pipe, p, r->block_sizes[index], fill);
+      else
+        mm_free(p);
       break;
 
     default:
-      app_error("invalid operation type  in eval_libc_valid");
+      app_error("Nonexistent request type in replay_thread");
     }
   }
+  return NULL;
+}
 
-  return 1;
+/*
+ * run_replay - Reset the heap and replay the trace from nthreads
+ *    threads at once. Returns the elapsed wall time in seconds.
+ */
+static double run_replay(replay_t *replays, int nthreads, int check) {
+  pthread_t tids[nthreads];
+  struct timeval start, end;
+  int t;
+
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in run_replay");
+
+  gettimeofday(&start, NULL);
+  for (t = 0; t < nthreads; t++) {
+    replays[t].check = check;
+    replays[t].full = 0;
+    if (pthread_create(&tids[t], NULL, replay_thread, &replays[t]) != 0)
+      unix_error("pthread_create failed in run_replay");
+  }
+  for (t = 0; t < nthreads; t++)
+    pthread_join(tids[t], NULL);
+  gettimeofday(&end, NULL);
+
+  return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
 }
 
 /*
- * eval_libc_speed - This is the function that is used by fcyc() to
- *    measure the running time of the libc malloc package on the set
- *    of traces.
+ * eval_mm_scaling - Replay the trace from 1 up to max_threads threads
+ *    and print the aggregate throughput for each thread count. Each
+ *    count is checked once for correctness, then timed as the best
+ *    of three runs. Running out of memory is not an error: the row
+ *    says so and the larger counts are skipped.
  */
-static void eval_libc_speed(void *ptr) {
-  int i;
-  int index, size, newsize;
-  char *p, *newp, *oldp, *block;
-  trace_t *trace = ((speed_t *)ptr)->trace;
+static void eval_mm_scaling(trace_t *trace, int tracenum, int max_threads) {
+  replay_t *replays;
+  double secs, best, base_kops = 0, kops;
+  int n, t, run;
+
+  if ((replays = (replay_t *)calloc(max_threads, sizeof(replay_t))) == NULL)
+    unix_error("calloc failed in eval_mm_scaling");
+  for (t = 0; t < max_threads; t++) {
+    replays[t].trace = trace;
+    replays[t].tid = t;
+    replays[t].blocks = (char **)malloc(trace->num_ids * sizeof(char *));
+    replays[t].block_sizes = (size_t *)malloc(trace->num_ids * sizeof(size_t));
+    if (replays[t].blocks == NULL || replays[t].block_sizes == NULL)
+      unix_error("malloc failed in eval_mm_scaling");
+  }
 
-  for (i = 0; i < trace->num_ops; i++) {
-    switch (trace->ops[i].type) {
-    case ALLOC: /* malloc */
-      index = trace->ops[i].index;
-      size = trace->ops[i].size;
-      if ((p = malloc(size)) == NULL)
-        unix_error("malloc failed in eval_libc_speed");
+  printf("\nScaling of mm malloc on trace %d:\n", tracenum);
+  printf("%7s%10s%10s%9s\n", "threads", "secs", "Kops", "speedup");
+  for (n = 1; n <= max_threads; n++) {
+    run_replay(replays, n, 1);
+    for (t = 0; t < n; t++) {
+      if (replays[t].errors) {
+        malloc_error(tracenum, 0, "mm corrupted a block in -T replay");
+        goto out;
+      }
+    }
+    for (t = 0; t < n; t++) {
+      if (replays[t].full) {
+        printf("%7d  the heap ran out of memory, give it more with -M\n", n);
+        goto out;
+      }
+    }
+
+    best = DBL_MAX;
+    for (run = 0; run < 3; run++) {
+      secs = run_replay(replays, n, 0);
+      best = (secs < best) ? secs : best;
+    }
+    kops = (n * (double)trace->num_ops / 1e3) / best;
+    if (n == 1)
+      base_kops = kops;
+    printf("%7d%10.6f%10.0f%8.2fx\n", n, best, kops, kops / base_kops);
+  }
+
+out:
+  for (t = 0; t < max_threads; t++) {
+    free(replays[t].blocks);
+    free(replays[t].block_sizes);
+  }
+  free(replays);
+}
+
+/*
+ * pipe_wait - Back off while the other side of a ring catches up
+ */
+static void pipe_wait(int *spins) {
+  if (++*spins < 64)
+    __builtin_ia32_pause();
+  else
+    sched_yield();
+}
+
+/*
+ * pipe_handoff - Put a block the trace frees in the producer's ring,
+ *    waiting while the ring is full
+ */
+static void pipe_handoff(pipe_t *pp, char *p, int size, char fill) {
+  handoff_t *h;
+  int spins = 0;
+
+  while (pp->tail - __atomic_load_n(&pp->head, __ATOMIC_ACQUIRE) ==
+         PIPE_SLOTS)
+    pipe_wait(&spins);
+  h = &pp->ring[pp->tail % PIPE_SLOTS];
+  h->p = p;
+  h->size = size;
+  h->fill = fill;
+  __atomic_store_n(&pp->tail, pp->tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * pipe_producer - Replay the trace, handing its frees to the consumer
+ */
+static void *pipe_producer(void *arg) {
+  pipe_t *pp = (pipe_t *)arg;
+
+  replay_thread(&pp->producer);
+  __atomic_store_n(&pp->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/*
+ * pipe_consumer - Check and free the blocks of the ring until the
+ *    producer is done and the ring is empty
+ */
+static void *pipe_consumer(void *arg) {
+  pipe_t *pp = (pipe_t *)arg;
+  unsigned int head = 0;
+  int j, spins = 0;
+  handoff_t *h;
+
+  for (;;) {
+    if (head == __atomic_load_n(&pp->tail, __ATOMIC_ACQUIRE)) {
+      if (__atomic_load_n(&pp->done, __ATOMIC_ACQUIRE) &&
+          head == __atomic_load_n(&pp->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+      pipe_wait(&spins);
+      continue;
+    }
+    h = &pp->ring[head % PIPE_SLOTS];
+    if (pp->producer.check)
+      for (j = 0; j < h->size; j++)
+        if (h->p[j] != h->fill) {
+          pp->errors++;
+          break;
+        }
+    mm_free(h->p);
+    __atomic_store_n(&pp->head, ++head, __ATOMIC_RELEASE);
+    spins = 0;
+  }
+}
+
+/*
+ * run_pipeline - Reset the heap and replay the trace in npipes pairs at
+ *    once, with the remote frees of the mm package on or off. Returns the
+ *    elapsed wall time in seconds.
+ */
+static double run_pipeline(pipe_t *pipes, int npipes, int check,
+                           int remote) {
+  pthread_t tids[2 * npipes];
+  struct timeval start, end;
+  int t;
+
+  mm_set_remote_free(remote);
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in run_pipeline");
+
+  gettimeofday(&start, NULL);
+  for (t = 0; t < npipes; t++) {
+    pipes[t].producer.check = check;
+    pipes[t].producer.full = 0;
+    pipes[t].head = pipes[t].tail = 0;
+    pipes[t].done = 0;
+    if (pthread_create(&tids[2 * t], NULL, pipe_producer, &pipes[t]) != 0 ||
+        pthread_create(&tids[2 * t + 1], NULL, pipe_consumer, &pipes[t]) != 0)
+      unix_error("pthread_create failed in run_pipeline");
+  }
+  for (t = 0; t < 2 * npipes; t++)
+    pthread_join(tids[t], NULL);
+  gettimeofday(&end, NULL);
+
+  return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+/*
+ * eval_mm_pipeline - Replay the trace in npipes producer/consumer pairs,
+ *    once with frees that take the heap lock and once with remote frees,
+ *    and print the aggregate throughput of each. Each is checked once for
+ *    correctness, then timed as the best of three runs. Running out of
+ *    memory is not an error: the row says so.
+ */
+static void eval_mm_pipeline(trace_t *trace, int tracenum, int npipes) {
+  pipe_t *pipes;
+  double secs, best, kops[2];
+  long i, frees = 0;
+  int t, run, remote;
+
+  for (i = 0; i < trace->num_ops; i++)
+    if (trace->ops[i].type == FREE)
+      frees++;
+
+  if ((pipes = (pipe_t *)calloc(npipes, sizeof(pipe_t))) == NULL)
+    unix_error("calloc failed in eval_mm_pipeline");
+  for (t = 0; t < npipes; t++) {
+    replay_t *r = &pipes[t].producer;
+
+    r->trace = trace;
+    r->tid = t;
+    r->pipe = &pipes[t];
+    r->blocks = (char **)malloc(trace->num_ids * sizeof(char *));
+    r->block_sizes = (size_t *)malloc(trace->num_ids * sizeof(size_t));
+    pipes[t].ring = (handoff_t *)malloc(PIPE_SLOTS * sizeof(handoff_t));
+    if (r->blocks == NULL || r->block_sizes == NULL || pipes[t].ring == NULL)
+      unix_error("malloc failed in eval_mm_pipeline");
+  }
+
+  for (remote = 0; remote < 2; remote++) {
+    run_pipeline(pipes, npipes, 1, remote);
+    for (t = 0; t < npipes; t++) {
+      if (pipes[t].producer.errors || pipes[t].errors) {
+        malloc_error(tracenum, 0, "mm corrupted a block in -Q replay");
+        goto out;
+      }
+    }
+    for (t = 0; t < npipes; t++) {
+      if (pipes[t].producer.full) {
+        printf("%5d%8ld  the heap ran out of memory, give it more with -M\n",
+               tracenum, frees);
+        goto out;
+      }
+    }
+
+    best = DBL_MAX;
+    for (run = 0; run < 3; run++) {
+      secs = run_pipeline(pipes, npipes, 0, remote);
+      best = (secs < best) ? secs : best;
+    }
+    kops[remote] = (npipes * (double)trace->num_ops / 1e3) / best;
+  }
+  printf("%5d%8ld%11.0f%13.0f%8.2fx\n", tracenum, frees, kops[0], kops[1],
+         kops[1] / kops[0]);
+
+out:
+  for (t = 0; t < npipes; t++) {
+    free(pipes[t].producer.blocks);
+    free(pipes[t].producer.block_sizes);
+    free(pipes[t].ring);
+  }
+  free(pipes);
+}
+#else
+static void eval_mm_scaling(trace_t *trace, int tracenum, int max_threads) {
+  app_error("-T requires a thread-safe build (make mdriver-mt)");
+}
+
+static void eval_mm_pipeline(trace_t *trace, int tracenum, int npipes) {
+  app_error("-Q requires a thread-safe build (make mdriver-mt)");
+}
+#endif
+
+/*
+ * arena_corrupt - Return nonzero unless the size bytes at p all hold fill
+ */
+static int arena_corrupt(char *p, int size, char fill) {
+  int j;
+
+  for (j = 0; j < size; j++)
+    if (p[j] != fill)
+      return 1;
+  return 0;
+}
+
+/*
+ * eval_arena_replay - Reset the heap and replay the trace in arenas, the
+ *    function that fsecs times in the arena mode. A block is allocated in
+ *    the arena of the current lifetime, taking a spare arena or creating
+ *    one if the lifetime has none yet, and reallocated in the arena it
+ *    came from. Freeing a block only counts it: the arena is reset when
+ *    its last block is freed. In check mode every block is filled with a
+ *    pattern of its id and verified before it is reallocated or freed.
+ *    The replay stops early, setting full, if an arena cannot grow.
+ */
+static void eval_arena_replay(void *ptr) {
+  arena_replay_t *r = (arena_replay_t *)ptr;
+  trace_t *trace = r->trace;
+  long i, w, cur = 0;
+  long lifetimes = (trace->num_ops + r->window - 1) / r->window;
+  int index, size, oldsize, total = 0;
+  char *p, *oldp, fill;
+  traceop_t *op;
+
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_arena_replay");
+  memset(r->arenas, 0, lifetimes * sizeof(arena_t *));
+  memset(r->live, 0, lifetimes * sizeof(long));
+  r->num_spare = r->created = r->resets = 0;
+  r->peak = r->full = 0;
+
+  for (i = 0; i < trace->num_ops && !r->full; i++) {
+    op = &trace->ops[i];
+    index = op->index;
+    size = op->size;
+    fill = (char)(index * 31 + 7);
+
+    /* An arena whose lifetime is over and that is empty becomes spare */
+    if (i / r->window != cur) {
+      if (r->arenas[cur] != NULL && r->live[cur] == 0) {
+        r->spare[r->num_spare++] = r->arenas[cur];
+        r->arenas[cur] = NULL;
+      }
+      cur = i / r->window;
+    }
+
+    switch (op->type) {
+
+    case ALLOC:    /* arena_alloc */
+    case CALLOC:   /* arena_alloc and clear */
+    case MEMALIGN: /* arena_memalign */
+      if (r->arenas[cur] == NULL) {
+        if (r->num_spare > 0)
+          r->arenas[cur] = r->spare[--r->num_spare];
+        else if ((r->arenas[cur] = arena_create(0)) != NULL)
+          r->created++;
+        else {
+          r->full = 1;
+          break;
+        }
+      }
+      if (op->type == MEMALIGN)
+        p = arena_memalign(r->arenas[cur], TRACE_ALIGN(op), size);
+      else
+        p = arena_alloc(r->arenas[cur], size);
+      if (p == NULL) {
+        r->full = 1;
+        break;
+      }
+      if (op->type == CALLOC)
+        memset(p, 0, size);
+      if (r->check) {
+        if (!IS_ALIGNED(p) ||
+            (op->type == MEMALIGN && (size_t)p % TRACE_ALIGN(op) != 0))
+          r->errors++;
+        memset(p, fill, size);
+      }
       trace->blocks[index] = p;
+      trace->block_sizes[index] = size;
+      r->lifetime[index] = cur;
+      r->live[cur]++;
+      total += size;
       break;
 
-    case REALLOC: /* realloc */
-      index = trace->ops[i].index;
-      newsize = trace->ops[i].size;
+    case REALLOC: /* arena_alloc and copy */
+      w = r->lifetime[index];
       oldp = trace->blocks[index];
-      if ((newp = realloc(oldp, newsize)) == NULL)
-        unix_error("realloc failed in eval_libc_speed\n");
+      oldsize = trace->block_sizes[index];
+      if (r->check && arena_corrupt(oldp, oldsize, fill))
+        r->errors++;
+      if ((p = arena_alloc(r->arenas[w], size)) == NULL) {
+        r->full = 1;
+        break;
+      }
+      memcpy(p, oldp, (size < oldsize) ? size : oldsize);
+      if (r->check) {
+        if (!IS_ALIGNED(p))
+          r->errors++;
+        memset(p, fill, size);
+      }
+      trace->blocks[index] = p;
+      trace->block_sizes[index] = size;
+      total += size - oldsize;
+      break;
 
-      trace->blocks[index] = newp;
+    case FREE: /* the last free of a lifetime resets its arena */
+      w = r->lifetime[index];
+      oldsize = trace->block_sizes[index];
+      if (r->check && arena_corrupt(trace->blocks[index], oldsize, fill))
+        r->errors++;
+      total -= oldsize;
+      if (--r->live[w] == 0) {
+        arena_reset(r->arenas[w]);
+        r->resets++;
+        if (w != cur) {
+          r->spare[r->num_spare++] = r->arenas[w];
+          r->arenas[w] = NULL;
+        }
+      }
       break;
 
-    case FREE: /* free */
-      index = trace->ops[i].index;
-      block = trace->blocks[index];
-      free(block);
+    default:
+      app_error("Nonexistent request type in eval_arena_replay");
+    }
+    r->peak = (total > r->peak) ? total : r->peak;
+  }
+
+  for (w = 0; w < lifetimes; w++)
+    if (r->arenas[w] != NULL)
+      arena_destroy(r->arenas[w]);
+  while (r->num_spare > 0)
+    arena_destroy(r->spare[--r->num_spare]);
+}
+
+/*
+ * eval_mm_arena - Check the arena replay of a trace, then time it and
+ *    the mm package on the same trace, and print one row with the arenas
+ *    created, their resets, and the utilization and throughput of both.
+ *    Utilization is the peak payload over the peak of heap and mappings.
+ *    Blocks that outlive their lifetime keep whole arenas alive, so the
+ *    arenas may run out of memory where the mm package does not; the row
+ *    says so instead, which is not an error.
+ */
+static void eval_mm_arena(trace_t *trace, int tracenum, long window) {
+  long lifetimes = (trace->num_ops + window - 1) / window;
+  arena_replay_t r;
+  range_t *ranges = NULL;
+  speed_t speed_params;
+  double util, secs, mm_util, mm_secs;
+
+  memset(&r, 0, sizeof(r));
+  r.trace = trace;
+  r.window = window;
+  r.arenas = (arena_t **)malloc(lifetimes * sizeof(arena_t *));
+  r.spare = (arena_t **)malloc(lifetimes * sizeof(arena_t *));
+  r.live = (long *)malloc(lifetimes * sizeof(long));
+  r.lifetime = (long *)malloc(trace->num_ids * sizeof(long));
+  if (r.arenas == NULL || r.spare == NULL || r.live == NULL ||
+      r.lifetime == NULL)
+    unix_error("malloc failed in eval_mm_arena");
+
+  alloc = &builtins[BUILTIN_MM];
+  r.check = 1;
+  eval_arena_replay(&r);
+  if (r.errors) {
+    malloc_error(tracenum, 0, "arena replay returned a bad or corrupted block");
+    goto out;
+  }
+  if (r.full) {
+    printf("%5d%8ld%8ld  the arenas ran out of memory\n", tracenum, r.created,
+           r.resets);
+    goto out;
+  }
+  util = (double)r.peak / mem_peaksize();
+  if (!eval_mm_valid(trace, tracenum, &ranges))
+    goto out;
+  mm_util = eval_mm_util(trace, tracenum, &ranges);
+
+  r.check = 0;
+  speed_params.trace = trace;
+  speed_params.ranges = ranges;
+  pin_timing(1);
+  secs = fsecs(eval_arena_replay, &r);
+  mm_secs = fsecs(eval_mm_speed, &speed_params);
+  pin_timing(0);
+
+  printf("%5d%8ld%8ld%6.0f%%%9.0f%8.0f%%%9.0f%8.2fx\n", tracenum, r.created,
+         r.resets, util * 100, trace->num_ops / secs / 1e3, mm_util * 100,
+         trace->num_ops / mm_secs / 1e3, mm_secs / secs);
+
+out:
+  clear_ranges(&ranges);
+  free(r.arenas);
+  free(r.spare);
+  free(r.live);
+  free(r.lifetime);
+}
+
+/*
+ * libc_init - libc malloc needs no initialization
+ */
+static int libc_init(void) {
+  return 0;
+}
+
+/*
+ * malloc_zeroed - calloc on top of the malloc of the allocator that
+ *     alloc points to
+ */
+static void *malloc_zeroed(size_t nmemb, size_t size) {
+  void *p;
+
+  if (size != 0 && nmemb > SIZE_MAX / size)
+    return NULL;
+  if ((p = alloc->malloc(nmemb * size)) != NULL)
+    memset(p, 0, nmemb * size);
+  return p;
+}
+
+/*
+ * new_block - Call the allocator for an ALLOC, CALLOC or MEMALIGN request
+ */
+static void *new_block(traceop_t *op) {
+  switch (op->type) {
+  case CALLOC:
+    return alloc->calloc(1, op->size);
+  case MEMALIGN:
+    return alloc->memalign(TRACE_ALIGN(op), op->size);
+  default:
+    return alloc->malloc(op->size);
+  }
+}
+
+/*
+ * eval_mm_trace - Read one trace and check, time and, if it takes its
+ *    memory from memlib, measure the utilization of allocator a on it.
+ *    The memory model must have been set up with mem_init.
+ */
+static void eval_mm_trace(allocator_t *a, char *tracefile, int tracenum,
+                          stats_t *stats, range_t **ranges) {
+  trace_t *trace = read_trace(tracedir, tracefile);
+  speed_t speed_params;
+
+  alloc = a;
+  stats->ops = trace->num_ops;
+  if (verbose > 1)
+    printf("Checking %s malloc for correctness, ", a->name);
+  stats->valid = eval_mm_valid(trace, tracenum, ranges);
+  if (stats->valid) {
+    if (verbose > 1 && a->heap)
+      printf("efficiency, ");
+    if (a->heap)
+      stats->util = eval_mm_util(trace, tracenum, ranges);
+    speed_params.trace = trace;
+    speed_params.ranges = *ranges;
+    if (verbose > 1)
+      printf("and performance.\n");
+    pin_timing(1);
+    stats->secs = fsecs(eval_mm_speed, &speed_params);
+    if (perf_report)
+      fperf(eval_mm_speed, &speed_params, PERF_RUNS, stats->perf);
+    if (a->lat != NULL)
+      eval_mm_latency(trace, tracenum);
+    pin_timing(0);
+  }
+  free_trace(trace);
+}
+
+/*
+ * eval_parallel - Evaluate the traces in njobs worker processes. Each
+ *    worker has its own copy of the memory model, takes the next trace
+ *    number from a shared job pipe, runs libc malloc (if libc_stats is
+ *    not NULL) and the mm package on it, and writes a result_t back.
+ *    Only the checks overlap: timing runs wait for their core's token.
+ *    A worker that dies takes the traces it was running with it; those
+ *    are reported as errors.
+ */
+static void eval_parallel(char **tracefiles, int num_tracefiles,
+                          stats_t *libc_stats, stats_t *mm_stats, int njobs) {
+  int jobs[2], results[2];
+  int i, w, status, lost, ntokens;
+  char token = 0;
+  char *done;
+  pid_t pid;
+  result_t res;
+  range_t *ranges = NULL;
+
+  /* Queue up every trace number, then close the queue */
+  if (pipe(jobs) < 0 || pipe(results) < 0)
+    unix_error("pipe failed in eval_parallel");
+  for (i = 0; i < num_tracefiles; i++)
+    if (write(jobs[1], &i, sizeof(int)) != sizeof(int))
+      unix_error("write to the job pipe failed in eval_parallel");
+  close(jobs[1]);
+
+  /* One token per pinned core, so that timing runs never share a core */
+  ntokens = (num_timing_cpus > 0) ? num_timing_cpus : 1;
+  if ((core_tokens = malloc(ntokens * sizeof(*core_tokens))) == NULL)
+    unix_error("malloc failed in eval_parallel");
+  for (i = 0; i < ntokens; i++)
+    if (pipe(core_tokens[i]) < 0 || write(core_tokens[i][1], &token, 1) != 1)
+      unix_error("pipe failed in eval_parallel");
+
+  /* Don't let the workers inherit (and print again) buffered output */
+  fflush(stdout);
+  for (w = 0; w < njobs; w++) {
+    if ((pid = fork()) < 0)
+      unix_error("fork failed in eval_parallel");
+    if (pid > 0)
+      continue;
+
+    /* Worker: run traces until the queue is empty */
+    worker_id = w;
+    close(results[0]);
+    mem_init();
+    while (read(jobs[0], &i, sizeof(int)) == sizeof(int)) {
+      memset(&res, 0, sizeof(res));
+      res.tracenum = i;
+      res.errors = errors;
+      if (libc_stats != NULL)
+        eval_mm_trace(&builtins[BUILTIN_LIBC], tracefiles[i], i, &res.libc,
+                      &ranges);
+      eval_mm_trace(&builtins[BUILTIN_MM], tracefiles[i], i, &res.mm,
+                    &ranges);
+      res.errors = errors - res.errors;
+      fflush(stdout);
+      if (write(results[1], &res, sizeof(res)) != sizeof(res))
+        unix_error("write to the result pipe failed in eval_parallel");
+    }
+    _exit(0); /* the parent owns the stats arrays and stdio buffers */
+  }
+  close(jobs[0]);
+  close(results[1]);
+
+  /* Merge the results as they come in */
+  if ((done = calloc(num_tracefiles, 1)) == NULL)
+    unix_error("calloc failed in eval_parallel");
+  while (read(results[0], &res, sizeof(res)) == sizeof(res)) {
+    done[res.tracenum] = 1;
+    errors += res.errors;
+    if (libc_stats != NULL)
+      libc_stats[res.tracenum] = res.libc;
+    mm_stats[res.tracenum] = res.mm;
+  }
+  close(results[0]);
+
+  /* Reap the workers and account for any traces they lost */
+  lost = 0;
+  while ((pid = wait(&status)) > 0)
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      lost = 1;
+  for (i = 0; i < num_tracefiles; i++)
+    if (!done[i]) {
+      errors++;
+      printf("ERROR [trace %d]: worker died before reporting a result\n", i);
+    }
+  if (lost)
+    printf("ERROR: at least one -j worker did not exit cleanly\n");
+  free(done);
+  for (i = 0; i < ntokens; i++) {
+    close(core_tokens[i][0]);
+    close(core_tokens[i][1]);
+  }
+  free(core_tokens);
+  core_tokens = NULL;
+}
+
+/*
+ * parse_fit - Read the -F policy, one of fit_names, where "good" may be
+ *    followed by the number of probes, e.g. "good:16"
+ */
+static int parse_fit(char *arg) {
+  char *colon = strchr(arg, ':');
+  size_t len = (colon != NULL) ? (size_t)(colon - arg) : strlen(arg);
+  int p;
+
+  for (p = 0; p < MM_FIT_POLICIES; p++)
+    if (strlen(fit_names[p]) == len && strncmp(arg, fit_names[p], len) == 0)
       break;
+  if (p == MM_FIT_POLICIES)
+    app_error("-F needs default, first, next, best or good[:<probes>]");
+  if (colon != NULL && (p != MM_FIT_GOOD || atoi(colon + 1) <= 0))
+    app_error("only good fit takes a positive number of probes");
+  if (colon != NULL)
+    fit_probes = atoi(colon + 1);
+  return p;
+}
+
+/*
+ * eval_fit_sweep - Run every trace under every placement policy of
+ *    mm_set_fit, serially or with njobs workers, and print the
+ *    utilization and throughput of each policy per trace and over all
+ *    traces, marking the Pareto front.
+ */
+static void eval_fit_sweep(char **tracefiles, int num_tracefiles, int njobs) {
+  stats_t *stats; /* one row of num_tracefiles stats per policy */
+  stats_t *s;
+  range_t *ranges = NULL;
+  double util[MM_FIT_POLICIES], kops[MM_FIT_POLICIES];
+  double sum_util, ops, secs;
+  char label[MAXLINE];
+  int i, p;
+
+  stats = calloc(MM_FIT_POLICIES * num_tracefiles, sizeof(stats_t));
+  if (stats == NULL)
+    unix_error("calloc failed in eval_fit_sweep");
+  if (njobs <= 1)
+    mem_init();
+
+  for (p = 0; p < MM_FIT_POLICIES; p++) {
+    if (verbose > 1)
+      printf("\nTesting mm malloc with %s fit\n", fit_names[p]);
+    mm_set_fit(p, fit_probes);
+    s = &stats[p * num_tracefiles];
+    if (njobs > 1)
+      eval_parallel(tracefiles, num_tracefiles, NULL, s, njobs);
+    else
+      for (i = 0; i < num_tracefiles; i++)
+        eval_mm_trace(&builtins[BUILTIN_MM], tracefiles[i], i, &s[i],
+                      &ranges);
+  }
+  mm_set_fit(MM_FIT_DEFAULT, fit_probes);
+
+  printf("\nPlacement policies of mm malloc, good fit with %u probes "
+         "(* on the Pareto front):\n",
+         fit_probes);
+  printf("%5s %-8s %5s %8s\n", "trace", "policy", "util", "Kops");
+
+  /* One group of rows per trace, then the totals as printresults has them */
+  for (i = 0; i <= num_tracefiles; i++) {
+    for (p = 0; p < MM_FIT_POLICIES; p++) {
+      s = &stats[p * num_tracefiles];
+      if (i < num_tracefiles) {
+        util[p] = s[i].valid ? s[i].util : -1;
+        kops[p] = s[i].valid ? (s[i].ops / 1e3) / s[i].secs : -1;
+        continue;
+      }
+      sum_util = ops = secs = 0;
+      util[p] = 0;
+      for (i = 0; i < num_tracefiles && util[p] >= 0; i++) {
+        if (!s[i].valid)
+          util[p] = -1;
+        sum_util += s[i].util;
+        ops += s[i].ops;
+        secs += s[i].secs;
+      }
+      i = num_tracefiles;
+      if (util[p] >= 0) {
+        util[p] = sum_util / num_tracefiles;
+        kops[p] = (ops / 1e3) / secs;
+      }
     }
+    if (i < num_tracefiles)
+      sprintf(label, "%d", i);
+    else
+      strcpy(label, "all");
+    print_front(label, util, kops);
+  }
+  free(stats);
+}
+
+/*
+ * print_front - Print the utilization and throughput of every policy on
+ *    one trace (or all of them), with a * on those that no other policy
+ *    beats on both. A negative util marks a policy that failed the trace.
+ */
+static void print_front(char *label, double *util, double *kops) {
+  int p, q, front;
+
+  for (p = 0; p < MM_FIT_POLICIES; p++) {
+    if (util[p] < 0) {
+      printf("%5s %-8s %5s %8s\n", label, fit_names[p], "-", "-");
+      continue;
+    }
+    front = 1;
+    for (q = 0; q < MM_FIT_POLICIES; q++)
+      if (util[q] >= util[p] && kops[q] >= kops[p] &&
+          (util[q] > util[p] || kops[q] > kops[p]))
+        front = 0;
+    printf("%5s %-8s %4.0f%% %8.0f %s\n", label, fit_names[p],
+           util[p] * 100.0, kops[p], front ? "*" : "");
   }
 }
 
@@ -870,6 +2608,256 @@ static void eval_libc_speed(void *ptr) {
  * Some miscellaneous helper routines
  ************************************/
 
+/*
+ * parse_allocs - Read the -A list of allocators, e.g. "mm,libc,./x.so":
+ *    built-in names, or paths of shared objects that define mm_init,
+ *    mm_malloc, mm_free and mm_realloc on top of memlib (see the Makefile),
+ *    and maybe mm_calloc and mm_memalign
+ */
+static void parse_allocs(char *list) {
+  static char *syms[] = {"mm_init",    "mm_malloc", "mm_free",
+                         "mm_realloc", "mm_calloc", "mm_memalign"};
+  char path[MAXLINE];
+  allocator_t *a;
+  void *handle, **fns[6];
+  char *name;
+  int i;
+
+  for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+    compared = realloc(compared, (num_compared + 1) * sizeof(allocator_t));
+    if (compared == NULL)
+      unix_error("realloc failed in parse_allocs");
+    a = &compared[num_compared++];
+
+    for (i = 0; i < NUM_BUILTINS; i++)
+      if (strcmp(name, builtins[i].name) == 0)
+        break;
+    if (i < NUM_BUILTINS) {
+      *a = builtins[i];
+      continue;
+    }
+
+    /* dlopen only looks in the current directory for an explicit path */
+    sprintf(path, "%s%.1000s", strchr(name, '/') ? "" : "./", name);
+    if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+      sprintf(msg, "Could not load allocator: %.1000s", dlerror());
+      app_error(msg);
+    }
+    a->name = name;
+    a->heap = 1;
+    a->lat = NULL;
+
+    /* ISO C has no cast from dlsym's void * to a function pointer */
+    fns[0] = (void **)&a->init;
+    fns[1] = (void **)&a->malloc;
+    fns[2] = (void **)&a->free;
+    fns[3] = (void **)&a->realloc;
+    fns[4] = (void **)&a->calloc;
+    fns[5] = (void **)&a->memalign;
+    for (i = 0; i < 6; i++)
+      if ((*fns[i] = dlsym(handle, syms[i])) == NULL && i < 4) {
+        sprintf(msg, "%.900s does not define %s", name, syms[i]);
+        app_error(msg);
+      }
+    if (a->calloc == NULL)
+      a->calloc = malloc_zeroed;
+  }
+}
+
+/*
+ * eval_compare - Run every trace under each -A allocator in turn and
+ *    print their utilization, throughput and call latency side by side.
+ *    A - stands for a trace that the allocator failed, or for the
+ *    utilization of an allocator that does not use memlib.
+ */
+static void eval_compare(char **tracefiles, int num_tracefiles) {
+  static char *pct_names[] = {"p50", "p99", "p99.9", "max"};
+  static double pcts[] = {50, 99, 99.9, 100};
+  stats_t *stats; /* one row of num_tracefiles stats per allocator */
+  range_t *ranges = NULL;
+  double ns = 1e3 / fsecs_mhz();
+  unsigned long long count, calls;
+  char label[MAXLINE];
+  int a, i, t, p, b;
+
+  stats = calloc(num_compared * num_tracefiles, sizeof(stats_t));
+  if (stats == NULL)
+    unix_error("calloc failed in eval_compare");
+  mem_init();
+  for (a = 0; a < num_compared; a++) {
+    if (verbose > 1)
+      printf("\nTesting %s malloc\n", compared[a].name);
+    compared[a].lat = calloc(LAT_TYPES, sizeof(*compared[a].lat));
+    if (compared[a].lat == NULL)
+      unix_error("calloc failed in eval_compare");
+    for (i = 0; i < num_tracefiles; i++)
+      eval_mm_trace(&compared[a], tracefiles[i], i,
+                    &stats[a * num_tracefiles + i], &ranges);
+  }
+
+  print_compare("Utilization", stats, num_tracefiles, SHOW_UTIL);
+  print_compare("Throughput (Kops)", stats, num_tracefiles, SHOW_KOPS);
+  for (t = 0; perf_report && t < FPERF_EVENTS; t++) {
+    sprintf(label, "%s per 1000 ops", fperf_names[t]);
+    print_compare(label, stats, num_tracefiles, t);
+  }
+
+  /* Latency of each type of call over all the traces each one passed */
+  printf("\nLatency over all traces (ns):\n%-14s", "op");
+  for (a = 0; a < num_compared; a++)
+    printf(" %10.10s", compared[a].name);
+  printf("\n");
+  for (t = 0; t < LAT_TYPES; t++) {
+    for (a = 0, calls = 0; a < num_compared; a++)
+      for (b = 0; b < LAT_BUCKETS; b++)
+        calls += compared[a].lat[t][b];
+    if (calls == 0) /* no trace makes this kind of call */
+      continue;
+    for (p = 0; p < (int)(sizeof(pcts) / sizeof(pcts[0])); p++) {
+      sprintf(label, "%s %s", call_names[t], pct_names[p]);
+      printf("%-14s", label);
+      for (a = 0; a < num_compared; a++) {
+        for (b = count = 0; b < LAT_BUCKETS; b++)
+          count += compared[a].lat[t][b];
+        if (count > 0)
+          printf(" %10.0f", lat_percentile(compared[a].lat[t], pcts[p]) * ns);
+        else
+          printf(" %10s", "-");
+      }
+      printf("\n");
+    }
+  }
+
+  for (a = 0; a < num_compared; a++) {
+    free(compared[a].lat);
+    compared[a].lat = NULL;
+  }
+  free(stats);
+}
+
+/*
+ * print_compare - Print the utilization, the throughput or the count of
+ *    a -p event per 1000 ops (as show says) of every -A allocator on each
+ *    trace and over all traces
+ */
+static void print_compare(char *title, stats_t *stats, int num_tracefiles,
+                          int show) {
+  stats_t *s;
+  double util, ops, secs, count;
+  int a, i, t, lo, hi, valid;
+
+  printf("\n%s:\n%5s", title, "trace");
+  for (a = 0; a < num_compared; a++)
+    printf(" %10.10s", compared[a].name);
+  printf("\n");
+  for (i = 0; i <= num_tracefiles; i++) {
+    lo = (i < num_tracefiles) ? i : 0;
+    hi = (i < num_tracefiles) ? i + 1 : num_tracefiles;
+    if (i < num_tracefiles)
+      printf("%5d", i);
+    else
+      printf("%5s", "all");
+    for (a = 0; a < num_compared; a++) {
+      s = &stats[a * num_tracefiles];
+      valid = (show != SHOW_UTIL) || compared[a].heap;
+      util = ops = secs = count = 0;
+      for (t = lo; t < hi; t++) {
+        valid = valid && s[t].valid && (show < 0 || s[t].perf[show] >= 0);
+        util += s[t].util;
+        ops += s[t].ops;
+        secs += s[t].secs;
+        count += (show < 0) ? 0 : s[t].perf[show];
+      }
+      if (!valid)
+        printf(" %10s", "-");
+      else if (show == SHOW_UTIL)
+        printf(" %9.0f%%", util * 100.0 / (hi - lo));
+      else if (show == SHOW_KOPS)
+        printf(" %10.0f", (ops / 1e3) / secs);
+      else
+        printf(" %10.1f", count * 1000 / ops);
+    }
+    printf("\n");
+  }
+}
+
+/*
+ * eval_backings - Run the mm package on every trace with the heap on
+ *    small pages and then on huge pages (see mem_set_huge_pages), and
+ *    print the throughput and the dTLB misses per 1000 ops under both,
+ *    and the change in misses. The misses are counted like -p's; on a
+ *    machine without the counter only the throughput is compared.
+ */
+static void eval_backings(char **tracefiles, int num_tracefiles) {
+  stats_t *stats; /* one row of num_tracefiles stats per backing */
+  stats_t *s;
+  range_t *ranges = NULL;
+  double ops[2], secs[2], misses[2];
+  size_t huge = 0;
+  int b, i, t, lo, hi, valid, counted = 0;
+
+  stats = calloc(2 * num_tracefiles, sizeof(stats_t));
+  if (stats == NULL)
+    unix_error("calloc failed in eval_backings");
+  perf_report = 1;
+  for (b = 0; b < 2; b++) {
+    if (verbose > 1)
+      printf("\nTesting mm malloc on %s pages\n", b ? "huge" : "small");
+    mem_set_huge_pages(b);
+    mem_init();
+    for (i = 0; i < num_tracefiles; i++)
+      eval_mm_trace(&builtins[BUILTIN_MM], tracefiles[i], i,
+                    &stats[b * num_tracefiles + i], &ranges);
+    if (b == 1)
+      huge = mem_hugesize();
+    clear_ranges(&ranges);
+    mem_deinit();
+  }
+
+  printf("\nHeap backings, %.1f MB of the second heap on huge pages:\n",
+         huge / (double)(1 << 20));
+  printf("%5s%10s%10s%10s%10s%9s\n", "trace", "4K Kops", "2M Kops",
+         "4K dTLB", "2M dTLB", "change");
+  for (i = 0; i <= num_tracefiles; i++) {
+    lo = (i < num_tracefiles) ? i : 0;
+    hi = (i < num_tracefiles) ? i + 1 : num_tracefiles;
+    if (i < num_tracefiles)
+      printf("%5d", i);
+    else
+      printf("%5s", "all");
+    valid = 1;
+    for (b = 0; b < 2; b++) {
+      s = &stats[b * num_tracefiles];
+      ops[b] = secs[b] = misses[b] = 0;
+      for (t = lo; t < hi; t++) {
+        valid = valid && s[t].valid;
+        ops[b] += s[t].ops;
+        secs[b] += s[t].secs;
+        misses[b] += s[t].perf[FPERF_DTLB_MISSES];
+        counted = counted || s[t].perf[FPERF_DTLB_MISSES] >= 0;
+      }
+    }
+    if (!valid) {
+      printf("%10s%10s%10s%10s%9s\n", "-", "-", "-", "-", "-");
+      continue;
+    }
+    printf("%10.0f%10.0f", (ops[0] / 1e3) / secs[0], (ops[1] / 1e3) / secs[1]);
+    if (!counted) {
+      printf("%10s%10s%9s\n", "-", "-", "-");
+      continue;
+    }
+    printf("%10.1f%10.1f", misses[0] * 1000 / ops[0],
+           misses[1] * 1000 / ops[1]);
+    if (misses[0] > 0)
+      printf("%+8.1f%%\n", (misses[1] - misses[0]) * 100 / misses[0]);
+    else
+      printf("%9s\n", "-");
+  }
+  if (!counted)
+    printf("This machine does not count dTLB misses (see -p).\n");
+  free(stats);
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
@@ -904,6 +2892,110 @@ static void printresults(int n, stats_t *stats) {
   }
 }
 
+/*
+ * printperf - prints the events counted with -p per 1000 ops of each
+ *    trace, and the instructions per cycle
+ */
+static void printperf(int n, stats_t *stats) {
+  double sum[FPERF_EVENTS] = {0};
+  double ops = 0;
+  int i, e;
+
+  printf("%5s", "trace");
+  for (e = 0; e < FPERF_EVENTS; e++)
+    printf("%10s", fperf_names[e]);
+  printf("%6s\n", "IPC");
+  for (i = 0; i < n; i++) {
+    printf("%2d%3s", i, "");
+    if (stats[i].valid) {
+      print_events(stats[i].perf, stats[i].ops);
+      ops += stats[i].ops;
+      for (e = 0; e < FPERF_EVENTS; e++)
+        sum[e] += stats[i].perf[e];
+    } else {
+      print_events(NULL, 0);
+    }
+  }
+
+  /* Sum up the traces that the package passed */
+  printf("%5s", "Total");
+  print_events((ops > 0) ? sum : NULL, ops);
+}
+
+/*
+ * print_events - prints one row of printperf: the counts per 1000 ops
+ *    and the instructions per cycle, or - where nothing was counted
+ */
+static void print_events(double *counts, double ops) {
+  int e;
+
+  for (e = 0; e < FPERF_EVENTS; e++)
+    if (counts == NULL || counts[e] < 0)
+      printf("%10s", "-");
+    else
+      printf("%10.1f", counts[e] * 1000 / ops);
+  if (counts != NULL && counts[FPERF_CYCLES] > 0)
+    printf("%6.2f\n", counts[FPERF_INSTRUCTIONS] / counts[FPERF_CYCLES]);
+  else
+    printf("%6s\n", "-");
+}
+
+/*
+ * parse_cpus - Read the -c core list, e.g. "2,3" or "4-7"
+ */
+static void parse_cpus(char *list) {
+  char *p = list;
+  long lo, hi;
+
+  num_timing_cpus = 0;
+  while (*p != '\0') {
+    lo = hi = strtol(p, &p, 10);
+    if (*p == '-')
+      hi = strtol(p + 1, &p, 10);
+    if (lo < 0 || hi < lo || hi >= CPU_SETSIZE || (*p != ',' && *p != '\0'))
+      app_error("-c needs a list of cores such as 2,3 or 4-7");
+    if ((timing_cpus = realloc(timing_cpus, (num_timing_cpus + hi - lo + 1) *
+                                                sizeof(int))) == NULL)
+      unix_error("realloc failed in parse_cpus");
+    while (lo <= hi)
+      timing_cpus[num_timing_cpus++] = lo++;
+    if (*p == ',')
+      p++;
+  }
+  if (num_timing_cpus == 0)
+    app_error("-c needs at least one core");
+}
+
+/*
+ * pin_timing - Around a timing run, move this process onto the -c core
+ *    that belongs to it (on != 0), then back onto the cores it was
+ *    allowed before (on == 0). With -j, workers take turns on each core.
+ */
+static void pin_timing(int on) {
+  static cpu_set_t saved;
+  cpu_set_t set;
+  int k = (num_timing_cpus > 0) ? worker_id % num_timing_cpus : 0;
+  char token = 0;
+
+  if (on) {
+    if (core_tokens != NULL && read(core_tokens[k][0], &token, 1) != 1)
+      unix_error("read of a core token failed in pin_timing");
+    if (num_timing_cpus == 0)
+      return;
+    if (sched_getaffinity(0, sizeof(saved), &saved) < 0)
+      unix_error("sched_getaffinity failed in pin_timing");
+    CPU_ZERO(&set);
+    CPU_SET(timing_cpus[k], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+      unix_error("sched_setaffinity failed in pin_timing");
+  } else {
+    if (num_timing_cpus > 0 && sched_setaffinity(0, sizeof(saved), &saved) < 0)
+      unix_error("sched_setaffinity failed in pin_timing");
+    if (core_tokens != NULL && write(core_tokens[k][1], &token, 1) != 1)
+      unix_error("write of a core token failed in pin_timing");
+  }
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -923,23 +3015,47 @@ void unix_error(char *msg) {
 /*
  * malloc_error - Report an error returned by the mm_malloc package
  */
-void malloc_error(int tracenum, int opnum, char *msg) {
+void malloc_error(int tracenum, long opnum, char *msg) {
   errors++;
-  printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
+  printf("ERROR [trace %d, line %ld]: %s\n", tracenum, LINENUM(opnum), msg);
 }
 
 /*
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-  fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+  fprintf(stderr,
+          "Usage: mdriver [-hvValLpr] [-f <file>] [-t <dir>] [-T <n>] "
+          "[-Q <n>] [-j <n>] [-c <cpus>] [-H <file>] [-s <n>] [-S <file>] "
+          "[-R <n>] [-C <n>] [-F <fit>] [-P] [-A <allocs>] [-M <mb>] "
+          "[-uB]\n");
   fprintf(stderr, "Options\n");
   fprintf(stderr, "\t-a         Don't check the team structure.\n");
+  fprintf(stderr, "\t-A <list>  Compare allocators, e.g. mm,implicit,libc,"
+                  "./x.so.\n");
+  fprintf(stderr, "\t-B         Compare the heap on small and huge pages.\n");
+  fprintf(stderr, "\t-c <cpus>  Pin timing runs to these cores.\n");
+  fprintf(stderr, "\t-C <n>     Check the mm heap every <n> ops.\n");
   fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+  fprintf(stderr, "\t-F <fit>   Place blocks by default, first, next, best "
+                  "or good[:<n>] fit.\n");
   fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
   fprintf(stderr, "\t-h         Print this message.\n");
-  fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+  fprintf(stderr, "\t-H <file>  Like -L, also write <file>.<call>.hgrm.\n");
+  fprintf(stderr, "\t-j <n>     Run the traces in <n> worker processes.\n");
+  fprintf(stderr, "\t-l         Print the results of libc malloc as well.\n");
+  fprintf(stderr, "\t-L         Report the tail latency of mm calls.\n");
+  fprintf(stderr, "\t-M <mb>    Give the memory model <mb> MB.\n");
+  fprintf(stderr, "\t-p         Count cache misses and other events.\n");
+  fprintf(stderr, "\t-P         Compare all placement policies.\n");
+  fprintf(stderr, "\t-Q <n>     Replay in <n> producer/consumer pairs.\n");
+  fprintf(stderr, "\t-r         Report heap and resident bytes over time.\n");
+  fprintf(stderr, "\t-R <n>     Replay in arenas of <n> ops' lifetime.\n");
+  fprintf(stderr, "\t-s <n>     Sample the heap stats every <n> ops.\n");
+  fprintf(stderr, "\t-S <file>  Write the heap stats samples to <file>.\n");
   fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+  fprintf(stderr, "\t-T <n>     Measure scaling from 1 to <n> threads.\n");
+  fprintf(stderr, "\t-u         Back the heap with huge pages.\n");
   fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
   fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
@@ -3,10 +3,12 @@
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* mremap */
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -14,53 +16,135 @@
 #include "config.h"
 #include "memlib.h"
 
+#define MEM_LINE 256 /* longest line of /proc/self/smaps we read */
+
 /* private variables */
 static char *mem_start_brk; /* points to first byte of heap */
 static char *mem_brk;       /* points to last byte of heap */
 static char *mem_max_addr;  /* largest legal heap address */
+static char *mem_dirty;     /* the heap reads as zeros from here up */
+
+/* settings for the next mem_init */
+static size_t mem_max_heap = MAX_HEAP; /* bytes of heap plus mappings */
+static int mem_huge = 0;               /* back the heap with huge pages? */
+static size_t mem_huge_len;            /* length of that mapping, or 0 */
+
+/* live mappings handed out by mem_map, kept in an unordered array */
+typedef struct {
+  char *addr;
+  size_t len;
+} mapping_t;
+static mapping_t *mem_maps; /* the array */
+static int mem_num_maps;    /* entries in use */
+static int mem_max_maps;    /* entries allocated */
+static size_t mem_mapped;   /* sum of the lengths of all live mappings */
+static size_t mem_peak;     /* largest heap size plus mem_mapped so far */
+
+static char *mem_map_huge(size_t len);
+static void mem_drop_pages(char *lo, char *hi);
+static void mem_zero(char *lo, char *hi);
+static size_t mem_resident_pages(char *lo, char *hi);
+static void mem_unmap_all(void);
+static int mem_find_map(char *addr);
+static void mem_update_peak(void);
 
 /*
  * mem_init - initialize the memory system model
  */
 void mem_init(void) {
-  /* allocate the storage we will use to model the available VM */
-  if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+  /* allocate the storage we will use to model the available VM, as zeros */
+  mem_huge_len = 0;
+  if (mem_huge)
+    mem_start_brk = mem_map_huge(mem_max_heap);
+  else if ((mem_start_brk = (char *)calloc(1, mem_max_heap)) == NULL) {
     fprintf(stderr, "mem_init_vm: malloc error\n");
     exit(1);
   }
 
-  mem_max_addr = mem_start_brk + MAX_HEAP; /* max legal heap address */
-  mem_brk = mem_start_brk;                 /* heap is empty initially */
+  mem_max_addr = mem_start_brk + mem_max_heap; /* max legal heap address */
+  mem_brk = mem_start_brk;                     /* heap is empty initially */
+  mem_dirty = mem_start_brk;
+  mem_peak = 0;
 }
 
 /*
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void) {
-  free(mem_start_brk);
+  mem_unmap_all();
+  free(mem_maps);
+  mem_maps = NULL;
+  mem_max_maps = 0;
+  if (mem_huge_len > 0)
+    munmap(mem_start_brk, mem_huge_len);
+  else
+    free(mem_start_brk);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_set_max_heap - set the bytes that the heap and the mappings of the
+ *    next mem_init may hold together
+ */
+void mem_set_max_heap(size_t bytes) {
+  assert(bytes > 0);
+  mem_max_heap = bytes;
+}
+
+/*
+ * mem_set_huge_pages - back the heap of the next mem_init with huge
+ *    pages (on nonzero) or with malloc'ed memory
+ */
+void mem_set_huge_pages(int on) {
+  mem_huge = on;
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    dropping any mappings the previous run left behind
  */
 void mem_reset_brk() {
   mem_brk = mem_start_brk;
+  mem_unmap_all();
+  mem_peak = 0;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area, which
+ *    reads as zeros like fresh pages from the kernel. A negative incr
+ *    shrinks the heap and gives its whole pages back.
  */
 void *mem_sbrk(int incr) {
   char *old_brk = mem_brk;
 
-  if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+  if (incr < 0) {
+    if (mem_brk + incr < mem_start_brk) {
+      errno = EINVAL;
+      fprintf(stderr, "ERROR: mem_sbrk failed. Heap would shrink below "
+                      "its start...\n");
+      return (void *)-1;
+    }
+    mem_brk += incr;
+    mem_zero(mem_brk, old_brk);
+    if (mem_dirty == old_brk)
+      mem_dirty = mem_brk;
+    return (void *)old_brk;
+  }
+
+  if (((mem_brk + incr) > mem_max_addr) ||
+      (mem_heapsize() + mem_mapped + incr > mem_max_heap)) {
     errno = ENOMEM;
     fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
     return (void *)-1;
   }
   mem_brk += incr;
+  mem_update_peak();
+
+  /* a previous run's data above the break is cleared on the way up */
+  if (mem_dirty > old_brk)
+    memset(old_brk, 0, (mem_dirty < mem_brk ? mem_dirty : mem_brk) - old_brk);
+  if (mem_dirty < mem_brk)
+    mem_dirty = mem_brk;
   return (void *)old_brk;
 }
 
@@ -91,3 +175,254 @@ size_t mem_heapsize() {
 size_t mem_pagesize() {
   return (size_t)getpagesize();
 }
+
+/*
+ * mem_map - model of an anonymous mmap of len bytes. The heap and the
+ *    mappings share the mem_max_heap bytes of the model between them.
+ */
+void *mem_map(size_t len) {
+  void *addr;
+
+  assert(len > 0 && len % mem_pagesize() == 0);
+  if (mem_heapsize() + mem_mapped + len > mem_max_heap) {
+    errno = ENOMEM;
+    fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+    return (void *)-1;
+  }
+
+  if (mem_num_maps == mem_max_maps) {
+    mem_max_maps = mem_max_maps ? 2 * mem_max_maps : 16;
+    mem_maps = realloc(mem_maps, mem_max_maps * sizeof(mapping_t));
+    if (mem_maps == NULL) {
+      fprintf(stderr, "mem_map: realloc error\n");
+      exit(1);
+    }
+  }
+
+  addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+              -1, 0);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "ERROR: mem_map failed. mmap: %s\n", strerror(errno));
+    return (void *)-1;
+  }
+
+  mem_maps[mem_num_maps].addr = addr;
+  mem_maps[mem_num_maps].len = len;
+  mem_num_maps++;
+  mem_mapped += len;
+  mem_update_peak();
+  return addr;
+}
+
+/*
+ * mem_unmap - give back a whole mapping returned by mem_map or mem_remap
+ */
+void mem_unmap(void *addr, size_t len) {
+  int i = mem_find_map(addr);
+
+  assert(i >= 0 && mem_maps[i].len == len);
+  munmap(addr, len);
+  mem_mapped -= len;
+  mem_maps[i] = mem_maps[--mem_num_maps];
+}
+
+/*
+ * mem_remap - model of mremap with MREMAP_MAYMOVE
+ */
+void *mem_remap(void *addr, size_t old_len, size_t new_len) {
+  int i = mem_find_map(addr);
+  void *new_addr;
+
+  assert(i >= 0 && mem_maps[i].len == old_len);
+  assert(new_len > 0 && new_len % mem_pagesize() == 0);
+  if (new_len > old_len &&
+      mem_heapsize() + mem_mapped + (new_len - old_len) > mem_max_heap) {
+    errno = ENOMEM;
+    fprintf(stderr, "ERROR: mem_remap failed. Ran out of memory...\n");
+    return (void *)-1;
+  }
+
+  new_addr = mremap(addr, old_len, new_len, MREMAP_MAYMOVE);
+  if (new_addr == MAP_FAILED) {
+    fprintf(stderr, "ERROR: mem_remap failed. mremap: %s\n", strerror(errno));
+    return (void *)-1;
+  }
+
+  mem_maps[i].addr = new_addr;
+  mem_maps[i].len = new_len;
+  mem_mapped += new_len - old_len;
+  mem_update_peak();
+  return new_addr;
+}
+
+/*
+ * mem_discard - model of madvise(MADV_DONTNEED) on the heap: the whole
+ *    pages within addr..addr+len-1 stop being resident and read back as
+ *    zeros. The heap size does not change.
+ */
+void mem_discard(void *addr, size_t len) {
+  assert((char *)addr >= mem_start_brk && (char *)addr + len <= mem_brk);
+  mem_drop_pages(addr, (char *)addr + len);
+}
+
+/*
+ * mem_resident - returns how many bytes of the heap and the mappings
+ *    are backed by physical pages, as reported by mincore(2)
+ */
+size_t mem_resident() {
+  size_t resident = mem_resident_pages(mem_start_brk, mem_brk);
+
+  for (int i = 0; i < mem_num_maps; i++)
+    resident += mem_resident_pages(mem_maps[i].addr,
+                                   mem_maps[i].addr + mem_maps[i].len);
+  return resident * mem_pagesize();
+}
+
+/*
+ * mem_is_mapped - does lo..hi lie within one live mapping?
+ */
+int mem_is_mapped(void *lo, void *hi) {
+  for (int i = 0; i < mem_num_maps; i++)
+    if ((char *)lo >= mem_maps[i].addr &&
+        (char *)hi < mem_maps[i].addr + mem_maps[i].len)
+      return 1;
+  return 0;
+}
+
+/*
+ * mem_mapsize - returns the number of bytes currently mapped
+ */
+size_t mem_mapsize() {
+  return mem_mapped;
+}
+
+/*
+ * mem_peaksize - returns the high water mark of heap plus mappings
+ */
+size_t mem_peaksize() {
+  return mem_peak;
+}
+
+/*
+ * mem_hugesize - returns how many bytes of the heap the kernel backs with
+ *    transparent huge pages, summing the AnonHugePages of every area of
+ *    /proc/self/smaps that overlaps it (0 if that cannot be read)
+ */
+size_t mem_hugesize() {
+  char line[MEM_LINE];
+  unsigned long lo, hi, kb;
+  int in_heap = 0;
+  size_t bytes = 0;
+  FILE *fp;
+
+  if ((fp = fopen("/proc/self/smaps", "r")) == NULL)
+    return 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+      in_heap = lo < (uintptr_t)mem_max_addr && hi > (uintptr_t)mem_start_brk;
+    else if (in_heap && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+      bytes += (size_t)kb * 1024;
+  }
+  fclose(fp);
+  return bytes;
+}
+
+/*
+ * mem_map_huge - map len bytes, rounded up to whole huge pages, at a
+ *    multiple of MEM_HUGE_PAGE and ask for transparent huge pages. The
+ *    kernel backs each aligned 2 MB of it with one page (and one TLB
+ *    entry) when it can. Without THP support the heap still works, on
+ *    small pages.
+ */
+static char *mem_map_huge(size_t len) {
+  size_t huge = MEM_HUGE_PAGE;
+  size_t span, lead;
+  char *p, *start;
+
+  len = (len + huge - 1) & ~(huge - 1);
+  span = len + huge; /* room to align the start */
+  p = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+           0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "mem_init_vm: mmap: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  /* give back what lies outside the aligned len bytes */
+  start = (char *)(((uintptr_t)p + huge - 1) & ~(uintptr_t)(huge - 1));
+  lead = start - p;
+  if (lead > 0)
+    munmap(p, lead);
+  munmap(start + len, span - lead - len);
+
+  if (madvise(start, len, MADV_HUGEPAGE) < 0)
+    fprintf(stderr, "mem_init_vm: no transparent huge pages: %s\n",
+            strerror(errno));
+  mem_huge_len = len;
+  return start;
+}
+
+/* madvise away the whole pages within lo..hi-1 */
+static void mem_drop_pages(char *lo, char *hi) {
+  uintptr_t page = mem_pagesize();
+  uintptr_t start = ((uintptr_t)lo + page - 1) & ~(page - 1);
+  uintptr_t end = (uintptr_t)hi & ~(page - 1);
+
+  if (start < end)
+    madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+/* clear lo..hi-1, giving its whole pages back */
+static void mem_zero(char *lo, char *hi) {
+  uintptr_t page = mem_pagesize();
+  char *start = (char *)(((uintptr_t)lo + page - 1) & ~(page - 1));
+  char *end = (char *)((uintptr_t)hi & ~(page - 1));
+
+  if (start >= end) {
+    memset(lo, 0, hi - lo);
+    return;
+  }
+  memset(lo, 0, start - lo);
+  mem_drop_pages(start, end);
+  memset(end, 0, hi - end);
+}
+
+/* number of resident pages overlapping lo..hi-1 */
+static size_t mem_resident_pages(char *lo, char *hi) {
+  uintptr_t page = mem_pagesize();
+  uintptr_t start = (uintptr_t)lo & ~(page - 1);
+  size_t npages = ((uintptr_t)hi - start + page - 1) / page;
+  unsigned char *vec;
+  size_t resident = 0;
+
+  if (hi <= lo)
+    return 0;
+  if ((vec = malloc(npages)) == NULL) {
+    fprintf(stderr, "mem_resident: malloc error\n");
+    exit(1);
+  }
+  if (mincore((void *)start, npages * page, vec) == 0)
+    for (size_t i = 0; i < npages; i++)
+      resident += vec[i] & 1;
+  free(vec);
+  return resident;
+}
+
+static void mem_unmap_all(void) {
+  for (int i = 0; i < mem_num_maps; i++)
+    munmap(mem_maps[i].addr, mem_maps[i].len);
+  mem_num_maps = 0;
+  mem_mapped = 0;
+}
+
+static int mem_find_map(char *addr) {
+  for (int i = 0; i < mem_num_maps; i++)
+    if (mem_maps[i].addr == addr)
+      return i;
+  return -1;
+}
+
+static void mem_update_peak(void) {
+  if (mem_heapsize() + mem_mapped > mem_peak)
+    mem_peak = mem_heapsize() + mem_mapped;
+}
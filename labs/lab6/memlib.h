@@ -4,10 +4,25 @@ void mem_init(void);
 void mem_deinit(void);
 
 /*
- * Expands the heap by incr bytes, where incr is a positive non-zero integer and
- * returns a generic pointer to the first byte of the newly allocated heap area.
- * The semantics are identical to the Unix sbrk function, except that mem_sbrk
- * accepts only a positive non-zero integer argument.
+ * Settings of the memory model, which take effect at the next mem_init.
+ * mem_set_max_heap sets the bytes the heap and the mappings may hold
+ * together (MAX_HEAP of config.h unless set). mem_set_huge_pages(1) backs
+ * the heap with an anonymous mapping aligned to MEM_HUGE_PAGE bytes, with
+ * transparent huge pages asked for, instead of malloc'ed memory on small
+ * pages; mem_hugesize tells how much of it the kernel actually backs with
+ * huge pages.
+ */
+#define MEM_HUGE_PAGE (2 * (1 << 20))
+void mem_set_max_heap(size_t bytes);
+void mem_set_huge_pages(int on);
+size_t mem_hugesize(void);
+
+/*
+ * Expands the heap by incr bytes and returns a generic pointer to the first
+ * byte of the newly allocated heap area. The semantics are identical to the
+ * Unix sbrk function: the new area reads as zeros, even after mem_reset_brk,
+ * and a negative incr shrinks the heap and gives the whole pages above the
+ * new break back.
  */
 void *mem_sbrk(int incr);
 
@@ -23,4 +38,36 @@ void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 
 /* Returns the system’s page size in bytes (4K on Linux systems). */
-size_t mem_pagesize(void);
\ No newline at end of file
+size_t mem_pagesize(void);
+
+/*
+ * Simulated mmap/munmap/mremap for blocks kept outside the heap. len is a
+ * multiple of mem_pagesize(); mem_map and mem_remap return a page-aligned
+ * address, or (void *)-1 when the memory model is exhausted. New pages
+ * read as zeros. mem_remap may move the mapping, keeping its contents
+ * like realloc.
+ */
+void *mem_map(size_t len);
+void mem_unmap(void *addr, size_t len);
+void *mem_remap(void *addr, size_t old_len, size_t new_len);
+
+/*
+ * Simulated madvise(MADV_DONTNEED) on the heap: the whole pages within
+ * addr..addr+len-1 stop being resident and read back as zeros.
+ */
+void mem_discard(void *addr, size_t len);
+
+/* Returns the bytes of the heap and the mappings backed by physical pages. */
+size_t mem_resident(void);
+
+/* Returns 1 if lo..hi lies within a single live mapping, 0 otherwise. */
+int mem_is_mapped(void *lo, void *hi);
+
+/* Returns the number of bytes currently mapped with mem_map. */
+size_t mem_mapsize(void);
+
+/*
+ * Returns the peak of heap size plus mapped bytes since the last
+ * mem_reset_brk, i.e. the most memory the model ever handed out.
+ */
+size_t mem_peaksize(void);
\ No newline at end of file
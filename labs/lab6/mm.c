@@ -3,12 +3,61 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "mm.h"
 #include "memlib.h"
 
+#if MM_THREAD_SAFE
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+ * -DMM_HARDEN=1 builds a hardened package, to run on real traffic at a
+ * fraction of the cost of a sanitizer:
+ *  - the footer of every allocated block, the word right before the next
+ *    block's header, holds a canary: a hash of the block's address and a
+ *    key drawn by mm_init. Writing past the end of the payload changes it.
+ *  - free and realloc check that the block is in use and its canary
+ *    intact. A freed block that still looks allocated (deferred, see
+ *    MM_DEFER_COALESCE) has its canary inverted instead, a freed slab
+ *    slot its bit set, so a double free is caught.
+ *  - every MM_CHECK_EVERY calls into the heap, the next MM_CHECK_SLICE
+ *    blocks in address order are checked like mm_check does, so the
+ *    whole heap is checked over and over at a bounded cost per call.
+ * A problem is reported on stderr and the process aborts.
+ */
+#ifndef MM_HARDEN
+#define MM_HARDEN 0
+#endif
+#ifndef MM_CHECK_EVERY
+#define MM_CHECK_EVERY 16
+#endif
+#ifndef MM_CHECK_SLICE
+#define MM_CHECK_SLICE 4
+#endif
+
+/*
+ * Allocated blocks carry only a header; whether the previous block is
+ * allocated is kept in the PREV_ALLOC header bit instead of its footer.
+ * Build with -DMM_ALLOC_FOOTERS=1 to give allocated blocks a footer again;
+ * MM_HARDEN keeps its canaries there.
+ */
+#ifndef MM_ALLOC_FOOTERS
+#define MM_ALLOC_FOOTERS MM_HARDEN
+#endif
+#if MM_HARDEN && !MM_ALLOC_FOOTERS
+#error "MM_HARDEN keeps its canaries in the footers of allocated blocks"
+#endif
+
+// payloads are aligned like glibc's: 8 bytes on i386, 16 bytes on x86-64
+#if defined(__x86_64__)
+#define ALIGNMENT 16
+#else
 #define ALIGNMENT 8
-#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~0x7)
+#endif
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
 #define WSIZE 4
 #define DSIZE 8
 #define CHUNKSIZE (1 << 12)
@@ -25,55 +74,404 @@
 #define GET_SIZE(p) (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
 
+#define PREV_ALLOC 0x2
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+#define SET_PREV_ALLOC(p) PUT(p, GET(p) | PREV_ALLOC)
+#define CLEAR_PREV_ALLOC(p) PUT(p, GET(p) & ~PREV_ALLOC)
+
+// set on allocated blocks that realloc has grown at least once
+#define REALLOCED 0x4
+#define GET_REALLOCED(p) (GET(p) & REALLOCED)
+#define SET_REALLOCED(p) PUT(p, GET(p) | REALLOCED)
+
+// bytes of an allocated block that are not payload
+#define OVERHEAD (MM_ALLOC_FOOTERS ? DSIZE : WSIZE)
+
 #define HDRP(bp) ((char *)(bp)-WSIZE)
 #define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp)-WSIZE)))
+// only valid when the previous block is free, i.e. has a footer
 #define PREV_BLKP(bp) ((char *)(bp)-GET_SIZE(((char *)(bp)-DSIZE)))
 
-#define NEXT_FP(bp) ((int *)(bp))
-#define PREV_FP(bp) ((int *)((char *)(bp) + WSIZE))
+/*
+ * Free-list links are 32-bit byte offsets from the start of the heap, so
+ * a free block stays 16 bytes on 64-bit builds too. Offset 0 is the heap's
+ * padding word, never a block, and stands for NULL.
+ */
+#define GET_LINK(p) (GET(p) ? (void *)(heap_base + GET(p)) : NULL)
+#define PUT_LINK(p, bp) PUT(p, (bp) ? (char *)(bp)-heap_base : 0)
 
-#define NEXT_FP_CONTENT(bp) ((void *)*(int *)(bp))
-#define PREV_FP_CONTENT(bp) ((void *)*(int *)((char *)(bp) + WSIZE))
+#define NEXT_FP(bp) ((char *)(bp))
+#define PREV_FP(bp) ((char *)(bp) + WSIZE)
 
-#define SEG_CLASS(size) (MIN(MSB(size), SEGLIST_CLASSES) - 1)
+#define NEXT_FP_CONTENT(bp) GET_LINK(NEXT_FP(bp))
+#define PREV_FP_CONTENT(bp) GET_LINK(PREV_FP(bp))
+
+#define MSB(x) (31 - __builtin_clz(x))
+#define SEG_CLASS(size) (MSB((unsigned int)(size)) - 1)
 #define SEGLIST_CLASSES 32
-#define SEGLIST_ROOT(class) (heap_listp + (class * MIN_BLOCK_SIZE))
+#define SEGLIST_ROOT(class) (heap_listp + ((class)*MIN_BLOCK_SIZE))
+
+// blocks of 64 bytes and up live in size-ordered treaps, smaller in LIFO lists
+#define TREE_CLASS 5
+#define IS_TREE_CLASS(class) ((class) >= TREE_CLASS)
+
+// treap links reuse the free-list link words of the payload
+#define LEFT(bp) NEXT_FP(bp)
+#define RIGHT(bp) PREV_FP(bp)
+#define LINK(slot) NEXT_FP_CONTENT(slot)
+
+// nodes are keyed by (size, address) so that every key is unique
+#define KEY_LESS(a, b)                                                         \
+  (GET_SIZE(HDRP(a)) < GET_SIZE(HDRP(b)) ||                                    \
+   (GET_SIZE(HDRP(a)) == GET_SIZE(HDRP(b)) && (char *)(a) < (char *)(b)))
+// heap priority comes from hashing the address, so nothing extra is stored
+#define PRIORITY(bp) ((unsigned int)(uintptr_t)(bp)*2654435761u)
+
+#define ASIZE(size) MAX(MIN_BLOCK_SIZE, ALIGN((size) + OVERHEAD))
+
+// footer of an allocated block under MM_HARDEN, and of a freed one
+#define CANARY(bp) (PRIORITY((char *)(bp)-heap_base) ^ canary_key)
+#define FREED(bp) (~CANARY(bp))
+
+#if MM_HARDEN
+// the incremental check must not start at a header that is going away
+#define FORGET(bp)                                                             \
+  do {                                                                         \
+    if (check_next == (char *)(bp))                                            \
+      check_next = NULL;                                                       \
+  } while (0)
+#else
+#define FORGET(bp)
+#endif
+
+// placement policy in force until mm_set_fit is called, see mm.h
+#ifndef MM_FIT_POLICY
+#define MM_FIT_POLICY MM_FIT_DEFAULT
+#endif
+
+/*
+ * A block that realloc has grown before and now has to move gets
+ * MM_REALLOC_GROWTH percent more than asked for, so a block appended to
+ * over and over is copied O(log n) times. 0 turns over-allocation off.
+ */
+#ifndef MM_REALLOC_GROWTH
+#define MM_REALLOC_GROWTH 50
+#endif
+// size plus the growth, in two parts so that small sizes get theirs too
+#define GROWN(size)                                                            \
+  ((size) + (size) / 100 * MM_REALLOC_GROWTH +                                 \
+   (size) % 100 * MM_REALLOC_GROWTH / 100)
+
+/*
+ * Requests of MM_MMAP_THRESHOLD bytes and up get a mapping of their own
+ * from mem_map that mem_unmap gives back on free, so a burst of large
+ * buffers does not leave the heap big for ever. Their payload starts
+ * ALIGNMENT bytes into the mapping, or further for mm_memalign, behind a
+ * header holding the mapping's length and, before that, a word holding
+ * how far into the mapping the payload starts. They are told apart by
+ * lying outside the heap.
+ */
+#ifndef MM_MMAP_THRESHOLD
+#define MM_MMAP_THRESHOLD (128 * 1024)
+#endif
+#define MAP_LEN(size)                                                          \
+  (((size) + ALIGNMENT + mem_pagesize() - 1) & ~(mem_pagesize() - 1))
+// the largest request: MAP_LEN must neither wrap nor outgrow a header word
+#define MAP_MAX ((size_t)UINT32_MAX - ALIGNMENT - mem_pagesize() + 1)
+#define MAP_START(bp) ((char *)(bp)-GET((char *)(bp)-DSIZE))
+#define IS_MAPPED(bp)                                                          \
+  ((char *)(bp) < heap_base || (char *)(bp) > (char *)mem_heap_hi())
+
+/*
+ * A free block that grows to trim_threshold bytes gives memory back: at
+ * the top of the heap all but CHUNKSIZE of it is returned through a
+ * negative mem_sbrk, inside the heap its whole pages are discarded once
+ * it is INTERIOR_TRIM times larger still. trim_threshold starts out at
+ * MM_TRIM_THRESHOLD on every mm_init and, like glibc's, doubles whenever
+ * the heap has to grow back over memory it gave away, up to
+ * TRIM_THRESHOLD_MAX.
+ */
+#ifndef MM_TRIM_THRESHOLD
+#define MM_TRIM_THRESHOLD (128 * 1024)
+#endif
+#define TRIM_THRESHOLD_MAX (32 * 1024 * 1024)
+#define INTERIOR_TRIM 4
+
+/*
+ * Freed blocks first go on an unsorted LIFO list, still marked allocated,
+ * and malloc hands them out again on an exact size match. The blocks the
+ * search passes over are coalesced into the seglists, and all of them are
+ * once more than DEFER_MAX are waiting. -DMM_DEFER_COALESCE=0 coalesces
+ * on every free instead.
+ */
+#ifndef MM_DEFER_COALESCE
+#define MM_DEFER_COALESCE 1
+#endif
+#define DEFER_MAX 64
+
+/*
+ * Requests of up to MM_SLAB_MAX bytes are served from slab pages:
+ * page-aligned heap blocks cut into headerless slots of one size, with a
+ * bitmap of free slots in the page header. -DMM_SLAB_MAX=0 turns it off.
+ */
+#ifndef MM_SLAB_MAX
+#define MM_SLAB_MAX 64
+#endif
+#define SLAB_PAGE 4096
+// a whole page, so that pages carved one after the other tile the heap;
+// the next block's header takes the last word
+#define SLAB_BLOCK_SIZE SLAB_PAGE
+#define SLAB_CLASSES (MM_SLAB_MAX / ALIGNMENT)
+#define SLAB_CLASS(size) (ALIGN(size) / ALIGNMENT - 1)
+#define SLAB_MAGIC 0x5ab1e5edu // odd, so slab_magic takes 2^32 inits to repeat
+
+// the spare second word of the first SLAB_CLASSES seglist roots heads the
+// list of that slot size's pages that still have free slots
+#define SLAB_ROOT(class) PREV_FP(SEGLIST_ROOT(class))
+
+/*
+ * Page header: cookie, slot size, free slots, next/prev links, then one
+ * bit per slot (set = free). The cookie is the page's heap offset xor
+ * slab_magic, which tells a slab page from an ordinary block at free time;
+ * slab_magic changes with every mm_init, as pages of the previous heap
+ * are still in memory after mem_reset_brk.
+ * SLAB_HDR covers the bitmap of the smallest slot size, 499 slots of 8.
+ */
+#define SLAB_HDR 96
+#define SLAB_COOKIE(pg) ((unsigned int)((char *)(pg)-heap_base) ^ slab_magic)
+#define SLAB_SLOT(pg) (((unsigned int *)(pg))[1])
+#define SLAB_FREE(pg) (((unsigned int *)(pg))[2])
+#define SLAB_NEXT(pg) ((char *)(pg) + 3 * WSIZE)
+#define SLAB_PREV(pg) ((char *)(pg) + 4 * WSIZE) // link word pointing at pg
+#define SLAB_BITMAP(pg) ((unsigned int *)(pg) + 5)
+#define SLAB_NSLOTS(slot) ((SLAB_BLOCK_SIZE - OVERHEAD - SLAB_HDR) / (slot))
+
+/*
+ * Live heap blocks of more than MM_SLAB_MAX and up to HIST_MAX usable
+ * bytes are counted in a histogram at the start of the heap, one word
+ * per ALIGNMENT bytes. A block is counted by its own size whenever it is
+ * handed out and taken off by that same size when it is freed or resized,
+ * so blocks that were not split or grew in place keep the counts exact.
+ * A request whose blocks have HOT_PAGES pages' worth of slots live gets
+ * slab pages of its own, on the slab roots after the first SLAB_CLASSES,
+ * if headerless slots waste less than blocks would; the word of the slot
+ * size keeps its hot class. Up to MM_HOT_CLASSES sizes are promoted per
+ * mm_init. -DMM_HOT_CLASSES=0 turns it off.
+ */
+#ifndef MM_HOT_CLASSES
+#define MM_HOT_CLASSES 4
+#endif
+#define HIST_MAX 1024
+#define HIST_BYTES ALIGN((HIST_MAX / ALIGNMENT + 1) * WSIZE)
+#define HIST(size) ((unsigned int *)heap_base + ALIGN(size) / ALIGNMENT)
+#define HOT_PAGES 8
+// the top bits of a counter hold the size's hot class plus one
+#define HOT_SHIFT 28
+#define HIST_COUNT(word) ((word) & ((1u << HOT_SHIFT) - 1))
+#define HOT_ROOT(word) SLAB_ROOT(SLAB_CLASSES + ((word) >> HOT_SHIFT) - 1)
+#define IS_HOT_SIZE(size)                                                      \
+  (MM_SLAB_MAX > 0 && MM_HOT_CLASSES > 0 && (size) > MM_SLAB_MAX &&            \
+   (size) <= HIST_MAX)
+// n slots save on n blocks of ASIZE(slot) bytes what the page costs
+#define SLAB_PAYS(slot) (SLAB_NSLOTS(slot) * ASIZE(slot) > SLAB_BLOCK_SIZE)
+
+/*
+ * The heap grows by at least chunk_size bytes at a time. chunk_size
+ * starts out at CHUNKSIZE and doubles with every extension while it is
+ * below MM_CHUNK_MAX and 1/CHUNK_SHARE of the heap, so a heap that keeps
+ * growing calls mem_sbrk less and less often. A trim sets it back.
+ */
+#ifndef MM_CHUNK_MAX
+#define MM_CHUNK_MAX (1024 * 1024)
+#endif
+#define CHUNK_SHARE 64
+
+#if MM_THREAD_SAFE
+// per-thread cache: one LIFO bin per block size up to TCACHE_MAX_SIZE
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGNMENT + 1)
+#define TCACHE_COUNT 32 // blocks a bin may hold before draining half
+#define TCACHE_BATCH 16 // blocks moved per refill under one lock
+// bins are keyed by usable bytes: every block in bin i has i * ALIGNMENT
+#define TC_BIN(size) ((size) / ALIGNMENT)
+
+// tcache block layout: TCACHE_BINS counts, then TCACHE_BINS list heads
+#define TC_HEADS_OFFSET ALIGN(TCACHE_BINS * sizeof(unsigned int))
+#define TC_BYTES (TC_HEADS_OFFSET + TCACHE_BINS * sizeof(void *))
+#define TC_COUNT(tc, i) (((unsigned int *)(tc))[i])
+#define TC_HEAD(tc, i) (((void **)((char *)(tc) + TC_HEADS_OFFSET))[i])
+#define TC_NEXT(bp) (*(void **)(bp))
+// under MM_HARDEN, the tcache a cached block is in, for spotting double frees;
+// only blocks of two words or more have room for it next to TC_NEXT
+#define TC_KEY(bp) (((void **)(bp))[1])
+#define TC_KEYED(bin) ((bin)*ALIGNMENT >= 2 * sizeof(void *))
+
+/*
+ * A free that would take the heap lock (a block the tcache does not keep,
+ * or the half of a full bin) pushes the blocks on remote_frees, a stack
+ * linked through TC_NEXT, with one compare-and-swap instead. Whoever
+ * takes the lock next, mostly a malloc slow path, pops the whole stack
+ * with one exchange and frees its blocks, so the stack has no ABA
+ * problem. MM_HARDEN frees under the lock so a double free is caught at
+ * the call. mm_set_remote_free switches at run time.
+ */
+#ifndef MM_REMOTE_FREE
+#define MM_REMOTE_FREE (!MM_HARDEN)
+#endif
+
+#define LOCK() heap_lock_acquire()
+#define UNLOCK() __atomic_store_n(&heap_lock, 0, __ATOMIC_RELEASE)
+#endif
 
 static void *extend_heap(size_t size);
+static void *extend_for(size_t asize);
+static void *grow_heap(size_t size);
 static void place(void *ptr, size_t size);
 static void *find_fit(size_t size);
+static void *class_fit(int seg_class, size_t size);
+static void *list_fit(void *bp, size_t size);
+static void *list_next_fit(void *head, void *start, size_t size);
 static void *coalesce(void *ptr);
+static void trim(void *bp);
+static void set_alloc(void *bp, size_t size);
+static void set_free(void *bp, size_t size);
 
 static void delete_node(void *ptr);
 static void insert_node(void *ptr);
-static int MSB(int size);
+static void tree_insert(char *slot, void *bp);
+static void tree_delete(char *slot, void *bp);
+static void *tree_fit(void *t, size_t size);
+static void *tree_next_fit(void *t, size_t size);
+
+static char *slab_page(void *ptr);
+static void *slab_alloc(char *root, unsigned int slot);
+static char *slab_root(unsigned int slot);
+static char *hot_root(size_t size);
+static void hist_add(void *bp, int n);
+static void slab_free(char *pg, void *ptr);
+static void slab_link(char *pg);
+static void slab_unlink(char *pg);
+static void *do_memalign(size_t align, size_t asize);
+static void *defer_take(size_t asize);
+static void *map_alloc(size_t align, size_t size);
+static void *map_realloc(void *bp, size_t size);
+static void map_free(void *bp);
+static int walk_blocks(int (*visit)(void *, size_t, int, void *), void *arg);
+static int block_kind(void *bp);
+static void collect_stats(mm_stats_t *st);
+static int count_block(void *bp, size_t size, int kind, void *arg);
+static int dump_block(void *bp, size_t size, int kind, void *arg);
+static const char *check_block(char *bp);
+static long check_list(int seg_class);
+static long check_tree(void *t, int seg_class, unsigned int prio);
+static int check_failed(const char *msg, void *bp);
+#if MM_HARDEN
+static void check_in_use(void *ptr, const char *call);
+static void check_slice(void);
+static void harden_fail(const char *call, const char *msg, void *bp);
+#endif
+
+static void *do_malloc(size_t size);
+static void do_free(void *ptr);
+static void *do_realloc(void *ptr, size_t size);
+static void *do_calloc(size_t size);
 
 char *heap_listp;
+static char *heap_base; // mem_heap_lo(), what free-list links are relative to
+static unsigned int seg_bitmap;  // bit i is set iff seglist i is non-empty
+static unsigned int slab_magic;  // SLAB_MAGIC times the number of mm_inits
+static void *defer_list;         // recently freed blocks, not yet coalesced
+static unsigned int defer_count; // blocks on defer_list
+static size_t trim_threshold;    // see MM_TRIM_THRESHOLD
+static int trimmed;              // the heap shrank since it last grew
+static size_t chunk_size;        // least heap extension, see MM_CHUNK_MAX
+static unsigned int hot_classes; // sizes promoted to slab pages so far
+static int fit_policy = MM_FIT_POLICY;          // see mm_set_fit
+static unsigned int fit_probes = MM_FIT_PROBES; // good-fit bound
+static char *grown;       // where the heap last grew, see do_calloc
+static char *rover;       // where next fit stopped, a free block in a list
+static size_t rover_size; // its size, which is its key in a tree class
+static unsigned int canary_key; // drawn by mm_init, see MM_HARDEN
+#if MM_HARDEN
+static char *check_next;         // where the next slice starts, or NULL
+static unsigned int check_calls; // calls into the heap since the last slice
+#endif
+
+#if MM_THREAD_SAFE
+static void heap_lock_acquire(void);
+static size_t usable_size(void *ptr);
+static char *tcache_get(void);
+static void *tcache_refill(char *tc, int bin);
+static void tcache_drain(char *tc, int bin, unsigned int count);
+static void tcache_release(void *tc);
+static void remote_push(void *first, void *last);
+static void remote_drain(void);
+#if MM_HARDEN
+static void tcache_check(char *tc, int bin, void *ptr);
+#endif
+
+static int heap_lock;            // spinlock guarding the heap and seglists
+static unsigned int heap_epoch;  // bumped by mm_init to invalidate tcaches
+static pthread_key_t tcache_key; // drains a thread's tcache when it exits
+static int tcache_key_created;
+static __thread char *tcache;              // this thread's cache, or NULL
+static __thread unsigned int tcache_epoch; // heap_epoch tcache belongs to
+static void *remote_frees;                 // blocks freed without the lock
+static int remote_free = MM_REMOTE_FREE;   // kept across mm_init
+#endif
 
 int mm_init(void) {
-  if ((heap_listp = mem_sbrk(DSIZE + (SEGLIST_CLASSES * MIN_BLOCK_SIZE))) ==
+#if MM_THREAD_SAFE
+  // mm_init is not thread-safe: callers must quiesce all other threads
+  if (!tcache_key_created) {
+    if (pthread_key_create(&tcache_key, tcache_release) != 0)
+      return -1;
+    tcache_key_created = 1;
+  }
+  heap_epoch++;
+  heap_lock = 0;
+  remote_frees = NULL;
+#endif
+
+  // histogram and alignment padding, then the seglist roots double as the
+  // prologue
+  heap_base = mem_heap_lo();
+  size_t pad = ALIGN((uintptr_t)heap_base + HIST_BYTES + WSIZE) -
+               (uintptr_t)heap_base;
+  if ((heap_listp = mem_sbrk(pad + (SEGLIST_CLASSES * MIN_BLOCK_SIZE))) ==
       (void *)-1)
     return -1;
 
-  PUT(heap_listp, 0); // alignment padding
-
-  // prologue
-  PUT(heap_listp + WSIZE, PACK(DSIZE, 1));
-  PUT(heap_listp + DSIZE, PACK(DSIZE, 1));
-  heap_listp += DSIZE;
+  memset(heap_listp, 0, pad);
+  heap_listp += pad;
+  hot_classes = 0;
+  chunk_size = CHUNKSIZE;
+  rover = NULL;
 
   // seglist
+  seg_bitmap = 0;
+  slab_magic += SLAB_MAGIC;
+  canary_key = PRIORITY(&canary_key) ^ slab_magic ^ (unsigned int)getpid();
+#if MM_HARDEN
+  check_next = NULL;
+  check_calls = 0;
+#endif
+  defer_list = NULL;
+  defer_count = 0;
+  trim_threshold = MM_TRIM_THRESHOLD;
+  trimmed = 0;
   for (int i = 0; i < SEGLIST_CLASSES; i++) {
     char *segroot = SEGLIST_ROOT(i);
-    PUT(HDRP(segroot), PACK(MIN_BLOCK_SIZE, 1));
-    PUT(segroot, NULL);
+    PUT(HDRP(segroot), PACK(MIN_BLOCK_SIZE, 1) | PREV_ALLOC);
+    PUT_LINK(NEXT_FP(segroot), NULL);
+    PUT_LINK(PREV_FP(segroot), NULL); // SLAB_ROOT for the first classes
     PUT(FTRP(segroot), PACK(MIN_BLOCK_SIZE, 1));
   }
 
   // epilogue
-  PUT(SEGLIST_ROOT(SEGLIST_CLASSES) + WSIZE, PACK(0, 1));
+  PUT(HDRP(SEGLIST_ROOT(SEGLIST_CLASSES)), PACK(0, 1) | PREV_ALLOC);
 
   if (extend_heap(CHUNKSIZE / WSIZE) == NULL)
     return -1;
@@ -83,41 +481,78 @@ int mm_init(void) {
 
 // Malloc
 void *mm_malloc(size_t size) {
-  size_t asize;
-  size_t extend_size;
-  char *bp;
-
   if (size == 0)
     return NULL;
 
-  if (size <= DSIZE)
-    asize = MIN_BLOCK_SIZE;
-  else
-    asize = ALIGN(size + DSIZE);
-
-  if ((bp = find_fit(asize)) != NULL) {
-    place(bp, asize);
-    return bp;
+#if MM_THREAD_SAFE
+  void *bp;
+
+  if (size <= TCACHE_MAX_SIZE) {
+    char *tc = tcache_get();
+    int bin = TC_BIN(ALIGN(size));
+
+    if (tc == NULL)
+      return NULL;
+    if ((bp = TC_HEAD(tc, bin)) != NULL) { // hot path: no lock
+      TC_HEAD(tc, bin) = TC_NEXT(bp);
+      TC_COUNT(tc, bin)--;
+#if MM_HARDEN
+      if (TC_KEYED(bin))
+        TC_KEY(bp) = NULL;
+#endif
+      return bp;
+    }
+    return tcache_refill(tc, bin);
   }
 
-  extend_size = MAX(asize, CHUNKSIZE);
-  if ((bp = extend_heap(extend_size / WSIZE)) == NULL)
-    return NULL;
-
-  place(bp, asize);
+  LOCK();
+  bp = do_malloc(size);
+  UNLOCK();
   return bp;
+#else
+  return do_malloc(size);
+#endif
 }
 
 // free
 void mm_free(void *ptr) {
-  size_t size = GET_SIZE(HDRP(ptr));
+#if MM_THREAD_SAFE
+  size_t size = usable_size(ptr);
+
+  if (size <= TCACHE_MAX_SIZE) {
+    char *tc = tcache_get();
+    int bin = TC_BIN(size);
+
+    if (tc != NULL) { // hot path: no lock
+#if MM_HARDEN
+      tcache_check(tc, bin, ptr);
+      if (TC_KEYED(bin))
+        TC_KEY(ptr) = tc;
+#endif
+      TC_NEXT(ptr) = TC_HEAD(tc, bin);
+      TC_HEAD(tc, bin) = ptr;
+      if (++TC_COUNT(tc, bin) > TCACHE_COUNT)
+        tcache_drain(tc, bin, TCACHE_COUNT / 2);
+      return;
+    }
+  }
 
-  PUT(HDRP(ptr), PACK(size, 0));
-  PUT(FTRP(ptr), PACK(size, 0));
-  coalesce(ptr);
+  if (__atomic_load_n(&remote_free, __ATOMIC_RELAXED)) {
+    remote_push(ptr, ptr);
+    return;
+  }
+  LOCK();
+  do_free(ptr);
+  UNLOCK();
+#else
+  do_free(ptr);
+#endif
 }
 
 void *mm_realloc(void *ptr, size_t size) {
+#if MM_THREAD_SAFE
+  void *new_ptr;
+
   if (size == 0) {
     mm_free(ptr);
     return NULL;
@@ -126,78 +561,466 @@ void *mm_realloc(void *ptr, size_t size) {
   if (ptr == NULL)
     return mm_malloc(size);
 
-  void *prev = PREV_BLKP(ptr);
-  int prev_alloc = GET_ALLOC(HDRP(prev));
-  size_t prev_size = GET_SIZE(HDRP(prev));
+  LOCK();
+  new_ptr = do_realloc(ptr, size);
+  UNLOCK();
+  return new_ptr;
+#else
+  return do_realloc(ptr, size);
+#endif
+}
+
+// calloc: a block the heap has just grown for is zero already
+void *mm_calloc(size_t nmemb, size_t size) {
+  size_t bytes;
+
+  if (__builtin_mul_overflow(nmemb, size, &bytes) || bytes == 0)
+    return NULL;
+
+#if MM_THREAD_SAFE
+  void *bp;
+
+  if (bytes <= TCACHE_MAX_SIZE) {
+    if ((bp = mm_malloc(bytes)) != NULL)
+      memset(bp, 0, bytes);
+    return bp;
+  }
+
+  LOCK();
+  bp = do_calloc(bytes);
+  UNLOCK();
+  return bp;
+#else
+  return do_calloc(bytes);
+#endif
+}
+
+// the slack in front of an aligned block goes back to the free lists
+void *mm_memalign(size_t align, size_t size) {
+  void *bp;
+
+  if (size == 0 || align == 0 || (align & (align - 1)) != 0)
+    return NULL;
+  if (align <= ALIGNMENT)
+    return mm_malloc(size);
+  if (size > MAP_MAX) // ASIZE would wrap
+    return NULL;
+
+#if MM_THREAD_SAFE
+  LOCK();
+#endif
+  if (size >= MM_MMAP_THRESHOLD)
+    bp = map_alloc(align, size);
+  else
+    bp = do_memalign(align, ASIZE(size));
+#if MM_THREAD_SAFE
+  UNLOCK();
+#endif
+  return bp;
+}
+
+// C17 dropped the rule that size be a multiple of align
+void *mm_aligned_alloc(size_t align, size_t size) {
+  return mm_memalign(align, size);
+}
+
+int mm_set_fit(int policy, unsigned int probes) {
+  if (policy < 0 || policy >= MM_FIT_POLICIES ||
+      (policy == MM_FIT_GOOD && probes == 0))
+    return -1;
+
+#if MM_THREAD_SAFE
+  LOCK();
+#endif
+  fit_policy = policy;
+  fit_probes = probes;
+  rover = NULL;
+#if MM_THREAD_SAFE
+  UNLOCK();
+#endif
+  return 0;
+}
+
+// switching off frees what is on the stack, as taking the lock does
+int mm_set_remote_free(int on) {
+#if MM_THREAD_SAFE
+  __atomic_store_n(&remote_free, on != 0, __ATOMIC_RELAXED);
+  LOCK();
+  UNLOCK();
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int mm_walk(int (*visit)(void *bp, size_t size, int kind, void *arg),
+            void *arg) {
+  int ret;
+
+#if MM_THREAD_SAFE
+  LOCK();
+#endif
+  ret = walk_blocks(visit, arg);
+#if MM_THREAD_SAFE
+  UNLOCK();
+#endif
+  return ret;
+}
+
+void mm_stats(mm_stats_t *stats) {
+#if MM_THREAD_SAFE
+  LOCK();
+#endif
+  collect_stats(stats);
+#if MM_THREAD_SAFE
+  UNLOCK();
+#endif
+}
+
+// the totals, the non-empty free-list classes, then every block
+void mm_dump(FILE *fp) {
+  mm_stats_t st;
+
+#if MM_THREAD_SAFE
+  LOCK();
+#endif
+  collect_stats(&st);
+  fprintf(fp, "heap %lu bytes, %lu more mapped\n", (unsigned long)st.heap_bytes,
+          (unsigned long)st.mapped_bytes);
+  fprintf(fp, "in use %lu blocks, %lu bytes (%lu slab pages, %lu bytes free)\n",
+          (unsigned long)st.alloc_blocks, (unsigned long)st.alloc_bytes,
+          (unsigned long)st.slab_pages, (unsigned long)st.slab_free);
+  fprintf(fp, "deferred %lu blocks, %lu bytes\n",
+          (unsigned long)st.deferred_blocks, (unsigned long)st.deferred_bytes);
+  fprintf(fp, "free %lu blocks, %lu bytes, largest %lu, fragmentation %.3f\n",
+          (unsigned long)st.free_blocks, (unsigned long)st.free_bytes,
+          (unsigned long)st.largest_free, st.external_frag);
+  for (int i = 0; i < MM_STATS_CLASSES; i++)
+    if (st.class_blocks[i] > 0)
+      fprintf(fp, "  class %2d: %lu blocks, %lu bytes\n", i,
+              (unsigned long)st.class_blocks[i],
+              (unsigned long)st.class_bytes[i]);
+  walk_blocks(dump_block, fp);
+#if MM_THREAD_SAFE
+  UNLOCK();
+#endif
+}
+
+// every block, then the free lists, which must hold exactly the free blocks
+int mm_check(void) {
+  const char *msg;
+  long free_blocks = 0, listed = 0, n;
+  unsigned int deferred = 0;
+  char *bp;
+  void *p;
+  int ret = 0;
+
+#if MM_THREAD_SAFE
+  LOCK();
+#endif
+  for (bp = SEGLIST_ROOT(SEGLIST_CLASSES);; bp = NEXT_BLKP(bp)) {
+    if ((msg = check_block(bp)) != NULL) {
+      ret = check_failed(msg, bp);
+      goto out;
+    }
+    if (GET_SIZE(HDRP(bp)) == 0)
+      break;
+    free_blocks += !GET_ALLOC(HDRP(bp));
+  }
+
+  for (int i = 0; i < SEGLIST_CLASSES; i++) {
+    void *head = NEXT_FP_CONTENT(SEGLIST_ROOT(i));
+
+    if (!(seg_bitmap & (1u << i)) != (head == NULL)) {
+      ret = check_failed("seg_bitmap disagrees with a seglist", head);
+      goto out;
+    }
+    n = IS_TREE_CLASS(i) ? check_tree(head, i, ~0u) : check_list(i);
+    if (n < 0) {
+      ret = -1;
+      goto out;
+    }
+    listed += n;
+  }
+  if (listed != free_blocks) {
+    ret = check_failed("free blocks missing from the seglists", NULL);
+    goto out;
+  }
+
+  for (p = defer_list; p != NULL && deferred <= defer_count;
+       p = GET_LINK(p), deferred++)
+    if (IS_MAPPED(p) || !GET_ALLOC(HDRP(p))) {
+      ret = check_failed("deferred block that is not in the heap", p);
+      goto out;
+    }
+  if (deferred != defer_count)
+    ret = check_failed("defer_count disagrees with the deferred list", NULL);
+
+out:
+#if MM_THREAD_SAFE
+  UNLOCK();
+#endif
+  return ret;
+}
+
+static void *do_malloc(size_t size) {
+  size_t asize = ASIZE(size);
+  char *bp;
+
+#if MM_HARDEN
+  if (++check_calls >= MM_CHECK_EVERY)
+    check_slice();
+#endif
+
+  if (size <= MM_SLAB_MAX)
+    return slab_alloc(SLAB_ROOT(SLAB_CLASS(size)), ALIGN(size));
+
+  if (IS_HOT_SIZE(size) && (bp = hot_root(size)) != NULL)
+    return slab_alloc(bp, ALIGN(size));
+
+  if (size >= MM_MMAP_THRESHOLD)
+    return map_alloc(ALIGNMENT, size);
+
+  if (!MM_DEFER_COALESCE || (bp = defer_take(asize)) == NULL) {
+    if ((bp = find_fit(asize)) == NULL && (bp = extend_for(asize)) == NULL)
+      return NULL;
+    place(bp, asize);
+  }
+  hist_add(bp, 1);
+  return bp;
+}
+
+static void do_free(void *ptr) {
+  char *pg;
+
+#if MM_HARDEN
+  check_in_use(ptr, "free");
+  if (++check_calls >= MM_CHECK_EVERY)
+    check_slice();
+#endif
+
+  if (IS_MAPPED(ptr)) {
+    map_free(ptr);
+    return;
+  }
+
+  if ((pg = slab_page(ptr)) != NULL) {
+    slab_free(pg, ptr);
+    return;
+  }
+
+  hist_add(ptr, -1);
+
+  if (MM_DEFER_COALESCE) {
+    PUT(HDRP(ptr), GET(HDRP(ptr)) & ~REALLOCED);
+    if (MM_HARDEN)
+      PUT(FTRP(ptr), FREED(ptr));
+    PUT_LINK(ptr, defer_list);
+    defer_list = ptr;
+    if (++defer_count > DEFER_MAX)
+      defer_take(0);
+    return;
+  }
+
+  set_free(ptr, GET_SIZE(HDRP(ptr)));
+  trim(coalesce(ptr));
+}
+
+static void *do_realloc(void *ptr, size_t size) {
+  if (size == 0) {
+    do_free(ptr);
+    return NULL;
+  }
+
+  if (ptr == NULL)
+    return do_malloc(size);
+
+#if MM_HARDEN
+  check_in_use(ptr, "realloc");
+#endif
+  if (size > MAP_MAX) // ASIZE would wrap; ptr stays as it is
+    return NULL;
+
+  // slots cannot grow in place: move out once the slot is too small
+  char *pg = slab_page(ptr);
+  if (pg != NULL) {
+    void *new_ptr;
+
+    if (size <= SLAB_SLOT(pg))
+      return ptr;
+    if ((new_ptr = do_malloc(size)) == NULL)
+      return NULL;
+    memcpy(new_ptr, ptr, SLAB_SLOT(pg));
+    slab_free(pg, ptr);
+    return new_ptr;
+  }
+
+  // mappings stay mappings and are resized without copying
+  if (IS_MAPPED(ptr)) {
+    void *new_ptr;
+
+    if (size >= MM_MMAP_THRESHOLD)
+      return map_realloc(ptr, size);
+    if ((new_ptr = do_malloc(size)) == NULL)
+      return NULL;
+    memcpy(new_ptr, ptr, size);
+    map_free(ptr);
+    return new_ptr;
+  }
+
+  int prev_alloc = GET_PREV_ALLOC(HDRP(ptr));
+  void *prev = prev_alloc ? NULL : PREV_BLKP(ptr);
+  size_t prev_size = prev_alloc ? 0 : GET_SIZE(HDRP(prev));
 
   void *next = NEXT_BLKP(ptr);
   int next_alloc = GET_ALLOC(HDRP(next));
   size_t next_size = GET_SIZE(HDRP(next));
+  size_t free_next = next_alloc ? 0 : next_size;
 
   size_t curr_size = GET_SIZE(HDRP(ptr));
-  void *tmp;
+  size_t payload = curr_size - OVERHEAD;
+  int regrown = GET_REALLOCED(HDRP(ptr));
 
   void *new_ptr = ptr;
-  size_t new_size;
-  if (size <= DSIZE)
-    new_size = 2 * DSIZE;
-  else
-    new_size = ALIGN(DSIZE + size);
+  size_t new_size = ASIZE(size);
+  size_t total;
 
+  // keep the slack for the next growth unless the block really shrinks
   if (new_size <= curr_size) {
-    place(ptr, new_size);
+    if (new_size <= curr_size / 2) {
+      hist_add(ptr, -1);
+      place(ptr, new_size);
+      hist_add(ptr, 1);
+    }
     return ptr;
   }
 
-  if ((!next_alloc) && (curr_size + next_size > new_size)) {
+  // the next block is free and big enough: no copy, and what is left over
+  // past the growth slack of a regrown block goes back to the free lists
+  if (curr_size + free_next >= new_size) {
     delete_node(next);
-    PUT(HDRP(ptr), PACK(curr_size + next_size, 1));
-    PUT(FTRP(ptr), PACK(curr_size + next_size, 1));
-    place(ptr, curr_size + next_size);
+    FORGET(next);
+    hist_add(ptr, -1);
+    set_alloc(ptr, curr_size + free_next);
+    if (regrown && size < MM_MMAP_THRESHOLD)
+      new_size = ASIZE(GROWN(size));
+    place(ptr, MIN(new_size, curr_size + free_next));
+    hist_add(ptr, 1);
+    SET_REALLOCED(HDRP(ptr));
     return ptr;
   }
 
-  else if (!prev_alloc && (prev_size > curr_size)) {
-    delete_node(prev);
-
-    PUT(HDRP(prev), PACK(new_size, 1));
-    memcpy(prev, ptr, MIN(new_size, curr_size));
-    PUT(FTRP(prev), PACK(new_size, 1));
+  // at the top of the heap: move the epilogue up by what is missing
+  if (next_size == 0 ||
+      (!next_alloc && GET_SIZE(HDRP(NEXT_BLKP(next))) == 0)) {
+    if (grow_heap(new_size - curr_size - free_next) != (void *)-1) {
+      if (!next_alloc) {
+        delete_node(next);
+        FORGET(next);
+      }
+      hist_add(ptr, -1);
+      PUT(HDRP((char *)ptr + new_size), PACK(0, 1));
+      set_alloc(ptr, new_size);
+      hist_add(ptr, 1);
+      SET_REALLOCED(HDRP(ptr));
+      return ptr;
+    }
+  }
 
-    if ((prev_size + curr_size) >= (new_size + 2 * DSIZE)) {
-      tmp = NEXT_BLKP(prev);
-      PUT(HDRP(tmp), PACK(prev_size + curr_size - new_size, 0));
-      PUT(FTRP(tmp), PACK(prev_size + curr_size - new_size, 0));
-      coalesce(tmp);
+  // both free neighbours at once, sliding the payload down into prev
+  total = prev_size + curr_size + free_next;
+  if (!prev_alloc && total >= new_size) {
+    hist_add(ptr, -1);
+    delete_node(prev);
+    if (!next_alloc) {
+      delete_node(next);
+      FORGET(next);
     }
+    FORGET(ptr);
+    memmove(prev, ptr, payload);
+
+    if (total >= new_size + MIN_BLOCK_SIZE) {
+      set_alloc(prev, new_size);
+      void *rest = NEXT_BLKP(prev);
+      PUT(HDRP(rest), PREV_ALLOC);
+      set_free(rest, total - new_size);
+      insert_node(rest); // both of its neighbours are allocated
+    } else
+      set_alloc(prev, total);
+    hist_add(prev, 1);
+    SET_REALLOCED(HDRP(prev));
     return prev;
   }
 
-  new_ptr = mm_malloc(size);
+  if (regrown && size < MM_MMAP_THRESHOLD) // remapping needs no slack
+    size = GROWN(size);
+  new_ptr = do_malloc(size);
   if (new_ptr == NULL)
     return NULL;
 
-  memcpy(new_ptr, ptr, MIN(size, curr_size));
-  mm_free(ptr);
+  memcpy(new_ptr, ptr, payload);
+  do_free(ptr);
+  if (size < MM_MMAP_THRESHOLD && slab_page(new_ptr) == NULL)
+    SET_REALLOCED(HDRP(new_ptr));
   return new_ptr;
 }
 
+/*
+ * Memory the heap grows by reads as zeros, so a block placed at the top
+ * after growing it needs clearing only below where the growth started,
+ * plus the free-list links at its start and the free block's old footer.
+ * Mappings are new pages. Everything else, slab slots included, is old.
+ */
+static void *do_calloc(size_t size) {
+  char *bp;
+
+  grown = NULL;
+  if ((bp = do_malloc(size)) == NULL || IS_MAPPED(bp))
+    return bp;
+
+  if (grown == NULL || slab_page(bp) != NULL) {
+    memset(bp, 0, size);
+    return bp;
+  }
+  memset(bp, 0, MIN(size, MAX((size_t)(grown - bp), DSIZE)));
+  if (!MM_ALLOC_FOOTERS)
+    PUT(FTRP(bp), 0);
+  return bp;
+}
+
 static void *extend_heap(size_t words) {
   char *bp;
 
   size_t size = ALIGN(words * WSIZE);
-  if ((bp = mem_sbrk(size)) == (void *)-1)
+  if ((bp = grow_heap(size)) == (void *)-1)
     return NULL;
+  grown = bp;
 
-  PUT(HDRP(bp), PACK(size, 0));
+  // the old epilogue header becomes bp's and still knows about prev
+  PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp)));
   PUT(FTRP(bp), PACK(size, 0));
   PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
 
   return coalesce(bp);
 }
 
+/*
+ * Grows the heap so that a free block of at least asize bytes ends it,
+ * asking only for what a free block at the top does not already have.
+ */
+static void *extend_for(size_t asize) {
+  char *epilogue = (char *)mem_heap_hi() + 1 - WSIZE;
+  size_t top = GET_PREV_ALLOC(epilogue) ? 0 : GET_SIZE(epilogue - WSIZE);
+  size_t size = MAX(asize - MIN(top, asize), chunk_size);
+
+  if (chunk_size < MM_CHUNK_MAX && chunk_size < mem_heapsize() / CHUNK_SHARE)
+    chunk_size *= 2;
+  return extend_heap(size / WSIZE);
+}
+
+// bp must already be marked free
 static void *coalesce(void *bp) {
-  size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+  size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
   size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
   size_t size = GET_SIZE(HDRP(bp));
 
@@ -208,48 +1031,151 @@ static void *coalesce(void *bp) {
 
   else if (prev_alloc && !next_alloc) {
     delete_node(NEXT_BLKP(bp));
+    FORGET(NEXT_BLKP(bp));
     size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
+    set_free(bp, size);
     insert_node(bp);
   }
 
   else if (!prev_alloc && next_alloc) {
     delete_node(PREV_BLKP(bp));
+    FORGET(bp);
     size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-    PUT(FTRP(bp), PACK(size, 0));
-    PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
     bp = PREV_BLKP(bp);
+    set_free(bp, size);
     insert_node(bp);
   }
 
   else {
     delete_node(PREV_BLKP(bp));
     delete_node(NEXT_BLKP(bp));
-    size += (GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp))));
-    PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-    PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+    FORGET(bp);
+    FORGET(NEXT_BLKP(bp));
+    size += (GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp))));
     bp = PREV_BLKP(bp);
+    set_free(bp, size);
     insert_node(bp);
   }
 
   return bp;
 }
 
-// First-fit
+// mem_sbrk for growth; growing back after a trim raises trim_threshold
+static void *grow_heap(size_t size) {
+  if (trimmed) {
+    trimmed = 0;
+    if (trim_threshold < TRIM_THRESHOLD_MAX)
+      trim_threshold *= 2;
+  }
+  return mem_sbrk(size);
+}
+
+static void trim(void *bp) {
+  size_t size = GET_SIZE(HDRP(bp));
+
+  if (size < trim_threshold)
+    return;
+
+  if (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0) {
+    delete_node(bp);
+    PUT(HDRP((char *)bp + CHUNKSIZE), PACK(0, 1));
+    PUT(HDRP(bp), PACK(CHUNKSIZE, 0) | GET_PREV_ALLOC(HDRP(bp)));
+    PUT(FTRP(bp), PACK(CHUNKSIZE, 0));
+    insert_node(bp);
+    mem_sbrk(-(int)(size - CHUNKSIZE));
+    trimmed = 1;
+    chunk_size = CHUNKSIZE;
+  } else if (size >= INTERIOR_TRIM * trim_threshold) {
+    // keep the tree links at the start and the footer at the end
+    mem_discard((char *)bp + DSIZE, size - 2 * DSIZE);
+  }
+}
+
+// Header (and footer if enabled) of an allocated block; keeps PREV_ALLOC
+static void set_alloc(void *bp, size_t size) {
+  PUT(HDRP(bp), PACK(size, 1) | GET_PREV_ALLOC(HDRP(bp)));
+#if MM_ALLOC_FOOTERS
+  PUT(FTRP(bp), MM_HARDEN ? CANARY(bp) : PACK(size, 1));
+#endif
+  SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+}
+
+// Header and footer of a free block; keeps PREV_ALLOC
+static void set_free(void *bp, size_t size) {
+  PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp)));
+  PUT(FTRP(bp), PACK(size, 0));
+  CLEAR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+}
+
 static void *find_fit(size_t size) {
-  int *ptr;
+  void *bp;
   int seg_class = SEG_CLASS(size);
+  unsigned int larger;
 
-  for (int class = seg_class; class < SEGLIST_CLASSES; class ++) {
-    ptr = NEXT_FP_CONTENT(SEGLIST_ROOT(class));
-    while (ptr != NULL) {
-      if (size <= GET_SIZE(HDRP(ptr)))
-        return ptr;
+  // the own class may hold blocks smaller than size, so search it
+  if ((seg_bitmap & (1u << seg_class)) &&
+      (bp = class_fit(seg_class, size)) != NULL)
+    return bp;
+
+  // every block of a larger class fits: one bit-scan finds the first one
+  larger = seg_bitmap & (~1u << seg_class);
+  if (larger == 0)
+    return NULL;
+  return class_fit(__builtin_ctz(larger), 0);
+}
+
+// a block of at least size bytes from a non-empty class, by fit_policy
+static void *class_fit(int seg_class, size_t size) {
+  void *head = NEXT_FP_CONTENT(SEGLIST_ROOT(seg_class));
+  int here = rover != NULL && SEG_CLASS(rover_size) == seg_class;
+  void *bp = NULL;
+
+  if (fit_policy != MM_FIT_NEXT)
+    return IS_TREE_CLASS(seg_class) ? tree_fit(head, size)
+                                    : list_fit(head, size);
+
+  // next fit goes on after the rover, wrapping around to the start
+  if (!IS_TREE_CLASS(seg_class))
+    bp = list_next_fit(head, here ? rover : head, size);
+  else if (!here || (bp = tree_next_fit(head, size)) == NULL)
+    bp = tree_fit(head, size);
+  if (bp != NULL) {
+    rover = bp; // delete_node moves a list rover on to the next block
+    rover_size = GET_SIZE(HDRP(bp));
+  }
+  return bp;
+}
+
+// first fit, or the smallest fit (among fit_probes blocks for good fit)
+static void *list_fit(void *bp, size_t size) {
+  void *best = NULL;
+  unsigned int probes = 0;
+
+  for (; bp != NULL; bp = NEXT_FP_CONTENT(bp)) {
+    size_t bsize = GET_SIZE(HDRP(bp));
 
-      ptr = NEXT_FP_CONTENT(ptr);
+    if (bsize >= size && (best == NULL || bsize < GET_SIZE(HDRP(best)))) {
+      best = bp;
+      if (bsize == size || fit_policy == MM_FIT_FIRST ||
+          fit_policy == MM_FIT_DEFAULT)
+        break;
     }
+    if (fit_policy == MM_FIT_GOOD && ++probes >= fit_probes && best != NULL)
+      break;
   }
+  return best;
+}
+
+// first fit from start on, wrapping around to head
+static void *list_next_fit(void *head, void *start, size_t size) {
+  void *bp = start;
+
+  do {
+    if (GET_SIZE(HDRP(bp)) >= size)
+      return bp;
+    if ((bp = NEXT_FP_CONTENT(bp)) == NULL)
+      bp = head;
+  } while (bp != start);
   return NULL;
 }
 
@@ -260,52 +1186,755 @@ static void place(void *bp, size_t asize) {
     delete_node(bp);
 
   if ((csize - asize) >= (MIN_BLOCK_SIZE)) {
-    PUT(HDRP(bp), PACK(asize, 1));
-    PUT(FTRP(bp), PACK(asize, 1));
+    set_alloc(bp, asize);
 
     bp = NEXT_BLKP(bp);
-    PUT(HDRP(bp), PACK(csize - asize, 0));
-    PUT(FTRP(bp), PACK(csize - asize, 0));
-    insert_node(bp);
+    PUT(HDRP(bp), PREV_ALLOC);
+    set_free(bp, csize - asize);
+    coalesce(bp); // a shrinking realloc may leave a free block after bp
   }
 
   else {
-    PUT(HDRP(bp), PACK(csize, 1));
-    PUT(FTRP(bp), PACK(csize, 1));
+    set_alloc(bp, csize);
   }
 }
 
-int MSB(int num) {
-  int r = 0;
-  while (num >>= 1)
-    r++;
-  return r;
+static void insert_node(void *bp) {
+  int seg_class = SEG_CLASS(GET_SIZE(HDRP(bp)));
+  void *root = SEGLIST_ROOT(seg_class);
+  void *next;
+
+  seg_bitmap |= 1u << seg_class;
+  if (IS_TREE_CLASS(seg_class)) {
+    tree_insert(root, bp);
+    return;
+  }
+
+  next = NEXT_FP_CONTENT(root);
+  if (next != NULL)
+    PUT_LINK(PREV_FP(next), bp);
+  PUT_LINK(NEXT_FP(bp), next);
+  PUT_LINK(PREV_FP(bp), root);
+  PUT_LINK(NEXT_FP(root), bp);
 }
 
-// referred
-// https://www.geeksforgeeks.org/insert-value-sorted-way-sorted-doubly-linked-list/
-static void insert_node(void *bp) {
-  size_t size = GET_SIZE(HDRP(bp));
-  void *prev = SEGLIST_ROOT(SEG_CLASS(size));
+// bp's header must still hold the size it was inserted with
+static void delete_node(void *bp) {
+  int seg_class = SEG_CLASS(GET_SIZE(HDRP(bp)));
+  void *root = SEGLIST_ROOT(seg_class);
+
+  if (IS_TREE_CLASS(seg_class)) {
+    tree_delete(root, bp);
+  } else {
+    void *next = NEXT_FP_CONTENT(bp);
+    void *prev = PREV_FP_CONTENT(bp);
+    PUT_LINK(NEXT_FP(prev), next);
+    if (next != NULL)
+      PUT_LINK(PREV_FP(next), prev);
+    if (bp == rover) {
+      rover = next;
+      rover_size = (next != NULL) ? GET_SIZE(HDRP(next)) : 0;
+    }
+  }
+
+  if (NEXT_FP_CONTENT(root) == NULL)
+    seg_bitmap &= ~(1u << seg_class);
+}
+
+/*
+ * Treap over (size, address). slot is the word holding the subtree root,
+ * i.e. a seglist root or the LEFT/RIGHT word of the parent node. Insert
+ * and delete are the iterative split/merge forms, O(log n) expected.
+ */
+static void tree_insert(char *slot, void *bp) {
+  unsigned int prio = PRIORITY(bp);
+  char *left = LEFT(bp);
+  char *right = RIGHT(bp);
+  void *t;
+
+  // descend to where bp's priority puts it ...
+  while ((t = LINK(slot)) != NULL && PRIORITY(t) > prio)
+    slot = KEY_LESS(bp, t) ? LEFT(t) : RIGHT(t);
+
+  // ... and split the subtree found there into bp's two children
+  while (t != NULL) {
+    if (KEY_LESS(t, bp)) {
+      PUT_LINK(left, t);
+      left = RIGHT(t);
+      t = LINK(left);
+    } else {
+      PUT_LINK(right, t);
+      right = LEFT(t);
+      t = LINK(right);
+    }
+  }
+  PUT_LINK(left, NULL);
+  PUT_LINK(right, NULL);
+  PUT_LINK(slot, bp);
+}
+
+static void tree_delete(char *slot, void *bp) {
+  void *t;
+  void *left = LINK(LEFT(bp));
+  void *right = LINK(RIGHT(bp));
+
+  while ((t = LINK(slot)) != bp)
+    slot = KEY_LESS(bp, t) ? LEFT(t) : RIGHT(t);
+
+  // merge the children in place of bp, keeping heap order on priorities
+  while (left != NULL && right != NULL) {
+    if (PRIORITY(left) > PRIORITY(right)) {
+      PUT_LINK(slot, left);
+      slot = RIGHT(left);
+      left = LINK(slot);
+    } else {
+      PUT_LINK(slot, right);
+      slot = LEFT(right);
+      right = LINK(slot);
+    }
+  }
+  PUT_LINK(slot, left != NULL ? left : right);
+}
+
+/*
+ * A block of at least size bytes: the first one met on the way down for
+ * first fit, else the smallest, lowest address among equals; good fit
+ * stops at the smallest of the first fit_probes nodes once one fits.
+ */
+static void *tree_fit(void *t, size_t size) {
+  void *best = NULL;
+  unsigned int probes = 0;
+
+  while (t != NULL) {
+    if (GET_SIZE(HDRP(t)) >= size) {
+      best = t;
+      if (fit_policy == MM_FIT_FIRST)
+        break;
+      t = LINK(LEFT(t));
+    } else
+      t = LINK(RIGHT(t));
+    if (fit_policy == MM_FIT_GOOD && ++probes >= fit_probes && best != NULL)
+      break;
+  }
+  return best;
+}
+
+// smallest block of at least size bytes whose key follows the rover's
+static void *tree_next_fit(void *t, size_t size) {
+  void *next = NULL;
+
+  while (t != NULL) {
+    size_t tsize = GET_SIZE(HDRP(t));
+
+    if (tsize >= size && (tsize > rover_size ||
+                          (tsize == rover_size && (char *)t > rover))) {
+      next = t;
+      t = LINK(LEFT(t));
+    } else
+      t = LINK(RIGHT(t));
+  }
+  return next;
+}
+
+/*
+ * Slab pages are found from a slot by rounding down to SLAB_PAGE. The
+ * rounded address is a slab page only if it holds the right cookie and
+ * is the payload of an allocated block of SLAB_BLOCK_SIZE bytes; an
+ * ordinary block can only fake that with user data at a page boundary.
+ */
+static char *slab_page(void *ptr) {
+  char *pg = (char *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE - 1));
+
+  if (MM_SLAB_MAX == 0 || (char *)ptr - pg < SLAB_HDR || pg <= heap_listp)
+    return NULL;
+  if (GET(pg) != SLAB_COOKIE(pg) || !GET_ALLOC(HDRP(pg)) ||
+      GET_SIZE(HDRP(pg)) - SLAB_BLOCK_SIZE >= MIN_BLOCK_SIZE)
+    return NULL;
+  return pg;
+}
+
+// lowest free slot of the first page with room, carving a new page if none
+static void *slab_alloc(char *root, unsigned int slot) {
+  char *pg = GET_LINK(root);
+  unsigned int *map;
+  unsigned int nslots, i, idx;
+
+  if (pg == NULL) {
+    if ((pg = do_memalign(SLAB_PAGE, SLAB_BLOCK_SIZE)) == NULL)
+      return NULL;
+
+    nslots = SLAB_NSLOTS(slot);
+    map = SLAB_BITMAP(pg);
+    PUT(pg, SLAB_COOKIE(pg));
+    SLAB_SLOT(pg) = slot;
+    SLAB_FREE(pg) = nslots;
+    for (i = 0; i < nslots / 32; i++)
+      map[i] = ~0u;
+    if (nslots % 32)
+      map[i] = (1u << (nslots % 32)) - 1;
+    slab_link(pg);
+  }
+
+  map = SLAB_BITMAP(pg);
+  for (i = 0; map[i] == 0; i++)
+    ;
+  idx = i * 32 + __builtin_ctz(map[i]);
+  map[i] &= map[i] - 1;
+
+  if (--SLAB_FREE(pg) == 0) // full pages leave the list
+    slab_unlink(pg);
+  return pg + SLAB_HDR + idx * SLAB_SLOT(pg);
+}
 
-  // sorted doubly linked list for optimization
-  while ((NEXT_FP_CONTENT(prev) != NULL) &&
-         (GET_SIZE(HDRP(NEXT_FP_CONTENT(prev))) < size))
-    prev = NEXT_FP_CONTENT(prev);
+/*
+ * An empty page goes back to the heap unless it is the only page of its
+ * slot size with room, so that one object being allocated and freed over
+ * and over does not carve and release a page each time.
+ */
+static void slab_free(char *pg, void *ptr) {
+  unsigned int idx = ((char *)ptr - pg - SLAB_HDR) / SLAB_SLOT(pg);
+  char *root = slab_root(SLAB_SLOT(pg));
+
+  SLAB_BITMAP(pg)[idx / 32] |= 1u << (idx % 32);
+
+  if (SLAB_FREE(pg)++ == 0) {
+    slab_link(pg);
+  } else if (SLAB_FREE(pg) == SLAB_NSLOTS(SLAB_SLOT(pg)) &&
+             (GET_LINK(root) != pg || GET_LINK(SLAB_NEXT(pg)) != NULL)) {
+    slab_unlink(pg);
+    PUT(pg, 0);
+    do_free(pg);
+  }
+}
+
+static void slab_link(char *pg) {
+  char *root = slab_root(SLAB_SLOT(pg));
+  char *next = GET_LINK(root);
 
-  void *next = NEXT_FP_CONTENT(prev);
   if (next != NULL)
-    PUT(PREV_FP(next), bp);
-  PUT(NEXT_FP(bp), next);
-  PUT(PREV_FP(bp), prev);
-  PUT(NEXT_FP(prev), bp);
+    PUT_LINK(SLAB_PREV(next), SLAB_NEXT(pg));
+  PUT_LINK(SLAB_NEXT(pg), next);
+  PUT_LINK(SLAB_PREV(pg), root);
+  PUT_LINK(root, pg);
 }
 
-static void delete_node(void *bp) {
-  void *next = NEXT_FP_CONTENT(bp);
-  void *prev = PREV_FP_CONTENT(bp);
-  PUT(NEXT_FP(prev), next);
+static void slab_unlink(char *pg) {
+  char *prev = GET_LINK(SLAB_PREV(pg));
+  char *next = GET_LINK(SLAB_NEXT(pg));
+
+  PUT_LINK(prev, next);
   if (next != NULL)
-    PUT(PREV_FP(next), prev);
-  return;
-}
\ No newline at end of file
+    PUT_LINK(SLAB_PREV(next), prev);
+}
+
+// the list head of the pages with slots of slot bytes
+static char *slab_root(unsigned int slot) {
+  if (slot <= MM_SLAB_MAX)
+    return SLAB_ROOT(SLAB_CLASS(slot));
+  return HOT_ROOT(*HIST(slot));
+}
+
+// the slab root of a request of size bytes if it is hot, or now turns hot
+static char *hot_root(size_t size) {
+  unsigned int *slot = HIST(size);
+  size_t usable = ASIZE(size) - OVERHEAD; // of the blocks it gets instead
+
+  if (*slot >> HOT_SHIFT)
+    return HOT_ROOT(*slot);
+
+  if (!IS_HOT_SIZE(usable) ||
+      HIST_COUNT(*HIST(usable)) < HOT_PAGES * SLAB_NSLOTS(ALIGN(size)) ||
+      hot_classes == MM_HOT_CLASSES || !SLAB_PAYS(ALIGN(size)))
+    return NULL;
+  *slot |= ++hot_classes << HOT_SHIFT;
+  return HOT_ROOT(*slot);
+}
+
+// adds n to the count of live heap blocks as large as bp
+static void hist_add(void *bp, int n) {
+  size_t usable = GET_SIZE(HDRP(bp)) - OVERHEAD;
+  unsigned int *count;
+
+  if (!IS_HOT_SIZE(usable))
+    return;
+  count = HIST(usable);
+  if (n > 0 || HIST_COUNT(*count) > 0)
+    *count += n;
+}
+
+/*
+ * Pops recently freed blocks until one of exactly asize bytes turns up,
+ * coalescing the others into the seglists. asize 0 coalesces them all.
+ */
+static void *defer_take(size_t asize) {
+  void *bp;
+
+  while ((bp = defer_list) != NULL) {
+    defer_list = GET_LINK(bp);
+    defer_count--;
+    if (GET_SIZE(HDRP(bp)) == asize) {
+      if (MM_HARDEN)
+        PUT(FTRP(bp), CANARY(bp));
+      return bp;
+    }
+    set_free(bp, GET_SIZE(HDRP(bp)));
+    trim(coalesce(bp));
+  }
+  return NULL;
+}
+
+static void *map_alloc(size_t align, size_t size) {
+  size_t len;
+  char *map, *bp;
+
+  if (size > MAP_MAX || align - ALIGNMENT > MAP_MAX - size)
+    return NULL;
+  len = MAP_LEN(size + align - ALIGNMENT);
+  if ((map = mem_map(len)) == (void *)-1)
+    return NULL;
+  bp = (char *)(((uintptr_t)map + ALIGNMENT + align - 1) & ~(align - 1));
+  PUT(bp - DSIZE, bp - map);
+  PUT(HDRP(bp), PACK(len, 1));
+  return bp;
+}
+
+// the payload keeps its offset into the mapping, aligned or not
+static void *map_realloc(void *bp, size_t size) {
+  size_t lead = GET((char *)bp - DSIZE);
+  size_t len;
+  char *map;
+
+  if (size > MAP_MAX - (lead - ALIGNMENT))
+    return NULL;
+  len = MAP_LEN(size + lead - ALIGNMENT);
+  map = mem_remap(MAP_START(bp), GET_SIZE(HDRP(bp)), len);
+  if (map == (void *)-1)
+    return NULL;
+  PUT(map + lead - WSIZE, PACK(len, 1));
+  return map + lead;
+}
+
+static void map_free(void *bp) {
+  mem_unmap(MAP_START(bp), GET_SIZE(HDRP(bp)));
+}
+
+/*
+ * Allocates a block of asize bytes whose payload is align-aligned. The
+ * slack in front of it is split off and goes back to the free lists.
+ */
+static void *do_memalign(size_t align, size_t asize) {
+  size_t size, lead, total;
+  char *bp, *abp;
+
+  if (asize > MAP_MAX || align > MAP_MAX - asize) // size would wrap
+    return NULL;
+  size = asize + align + MIN_BLOCK_SIZE;
+
+  // the best fit may be aligned already, like a slab page given back
+  if (((bp = find_fit(asize)) == NULL || ((uintptr_t)bp & (align - 1))) &&
+      (bp = find_fit(size)) == NULL && (bp = extend_for(size)) == NULL)
+    return NULL;
+
+  abp = (char *)(((uintptr_t)bp + align - 1) & ~(uintptr_t)(align - 1));
+  if (abp != bp) {
+    if (abp - bp < MIN_BLOCK_SIZE)
+      abp += align;
+    lead = abp - bp;
+    total = GET_SIZE(HDRP(bp));
+
+    delete_node(bp);
+    PUT(HDRP(abp), PACK(total - lead, 0)); // the lead block before is free
+    PUT(FTRP(abp), PACK(total - lead, 0));
+    PUT(HDRP(bp), PACK(lead, 0) | GET_PREV_ALLOC(HDRP(bp)));
+    PUT(FTRP(bp), PACK(lead, 0));
+    insert_node(bp);
+    insert_node(abp);
+  }
+
+  place(abp, asize);
+  hist_add(abp, 1);
+  return abp;
+}
+
+// visits the heap blocks in address order until visit returns nonzero
+static int walk_blocks(int (*visit)(void *, size_t, int, void *), void *arg) {
+  char *bp;
+  int ret;
+
+  for (bp = SEGLIST_ROOT(SEGLIST_CLASSES); GET_SIZE(HDRP(bp)) > 0;
+       bp = NEXT_BLKP(bp))
+    if ((ret = visit(bp, GET_SIZE(HDRP(bp)), block_kind(bp), arg)) != 0)
+      return ret;
+  return 0;
+}
+
+// deferred blocks look allocated, so they are looked up on defer_list
+static int block_kind(void *bp) {
+  void *p;
+
+  if (!GET_ALLOC(HDRP(bp)))
+    return MM_BLOCK_FREE;
+  if (((uintptr_t)bp & (SLAB_PAGE - 1)) == 0 &&
+      slab_page((char *)bp + SLAB_HDR) == bp)
+    return MM_BLOCK_SLAB;
+  for (p = defer_list; p != NULL; p = GET_LINK(p))
+    if (p == bp)
+      return MM_BLOCK_DEFERRED;
+  return MM_BLOCK_ALLOC;
+}
+
+static void collect_stats(mm_stats_t *st) {
+  memset(st, 0, sizeof(*st));
+  walk_blocks(count_block, st);
+  st->heap_bytes = mem_heapsize();
+  st->mapped_bytes = mem_mapsize();
+  if (st->free_bytes > 0)
+    st->external_frag = 1.0 - (double)st->largest_free / st->free_bytes;
+}
+
+static int count_block(void *bp, size_t size, int kind, void *arg) {
+  mm_stats_t *st = arg;
+  int seg_class;
+
+  switch (kind) {
+  case MM_BLOCK_FREE:
+    seg_class = SEG_CLASS(size);
+    st->free_blocks++;
+    st->free_bytes += size;
+    st->largest_free = MAX(st->largest_free, size);
+    st->class_blocks[seg_class]++;
+    st->class_bytes[seg_class] += size;
+    break;
+  case MM_BLOCK_DEFERRED:
+    st->deferred_blocks++;
+    st->deferred_bytes += size;
+    break;
+  case MM_BLOCK_SLAB:
+    st->slab_pages++;
+    st->slab_free += SLAB_FREE(bp) * SLAB_SLOT(bp);
+    // fall through
+  default:
+    st->alloc_blocks++;
+    st->alloc_bytes += size;
+  }
+  return 0;
+}
+
+static int dump_block(void *bp, size_t size, int kind, void *arg) {
+  FILE *fp = arg;
+
+  fprintf(fp, "%p %8lu ", bp, (unsigned long)size);
+  if (kind == MM_BLOCK_FREE)
+    fprintf(fp, "free\n");
+  else if (kind == MM_BLOCK_DEFERRED)
+    fprintf(fp, "deferred\n");
+  else if (kind == MM_BLOCK_SLAB)
+    fprintf(fp, "slab of %u-byte slots, %u free\n", SLAB_SLOT(bp),
+            SLAB_FREE(bp));
+  else
+    fprintf(fp, "allocated\n");
+  return 0;
+}
+
+/*
+ * The checks mm_check makes of one block in the heap, and the incremental
+ * check of MM_HARDEN too. Returns what is wrong, or NULL.
+ */
+static const char *check_block(char *bp) {
+  char *end = (char *)mem_heap_hi() + 1;
+  size_t size = GET_SIZE(HDRP(bp));
+  int alloc = GET_ALLOC(HDRP(bp));
+
+  if (size == 0)
+    return (HDRP(bp) == end - WSIZE) ? NULL : "epilogue inside the heap";
+  if (size < MIN_BLOCK_SIZE || size % ALIGNMENT != 0 ||
+      size > (size_t)(end - bp))
+    return "corrupted header";
+  if (!GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))) != !alloc)
+    return "PREV_ALLOC bit of the next block is wrong";
+  if (alloc) {
+    if (MM_HARDEN && GET(FTRP(bp)) != CANARY(bp) && GET(FTRP(bp)) != FREED(bp))
+      return "canary overwritten, the block overflowed";
+    return NULL;
+  }
+  if (GET(FTRP(bp)) != PACK(size, 0))
+    return "footer of a free block disagrees with its header";
+  if (!GET_ALLOC(HDRP(NEXT_BLKP(bp))))
+    return "two free blocks in a row";
+  if (GET(NEXT_FP(bp)) >= mem_heapsize() || GET(PREV_FP(bp)) >= mem_heapsize())
+    return "free-list link outside the heap";
+  return NULL;
+}
+
+// the blocks of a list class, or -1 at the first bad one
+static long check_list(int seg_class) {
+  char *prev = SEGLIST_ROOT(seg_class);
+  long n = 0;
+  char *bp;
+
+  for (bp = NEXT_FP_CONTENT(prev); bp != NULL; bp = NEXT_FP_CONTENT(bp)) {
+    if (IS_MAPPED(bp) || GET_ALLOC(HDRP(bp)))
+      return check_failed("allocated block on a seglist", bp);
+    if (SEG_CLASS(GET_SIZE(HDRP(bp))) != seg_class)
+      return check_failed("block on the seglist of another class", bp);
+    if (PREV_FP_CONTENT(bp) != prev)
+      return check_failed("broken prev link on a seglist", bp);
+    if (++n > (long)(mem_heapsize() / MIN_BLOCK_SIZE))
+      return check_failed("cycle on a seglist", bp);
+    prev = bp;
+  }
+  return n;
+}
+
+// the nodes of a treap whose parent has priority prio, or -1
+static long check_tree(void *t, int seg_class, unsigned int prio) {
+  void *left, *right;
+  long l, r;
+
+  if (t == NULL)
+    return 0;
+  if (IS_MAPPED(t) || GET_ALLOC(HDRP(t)))
+    return check_failed("allocated block in a seglist tree", t);
+  if (SEG_CLASS(GET_SIZE(HDRP(t))) != seg_class)
+    return check_failed("block in the seglist tree of another class", t);
+  if (PRIORITY(t) > prio)
+    return check_failed("tree node above its parent's priority", t);
+  left = LINK(LEFT(t));
+  right = LINK(RIGHT(t));
+  if ((left != NULL && !KEY_LESS(left, t)) ||
+      (right != NULL && !KEY_LESS(t, right)))
+    return check_failed("tree nodes out of order", t);
+  if ((l = check_tree(left, seg_class, PRIORITY(t))) < 0 ||
+      (r = check_tree(right, seg_class, PRIORITY(t))) < 0)
+    return -1;
+  return l + r + 1;
+}
+
+static int check_failed(const char *msg, void *bp) {
+  fprintf(stderr, "mm_check: %s at %p\n", msg, bp);
+  return -1;
+}
+
+#if MM_HARDEN
+// aborts unless ptr is a block in use with its canary intact
+static void check_in_use(void *ptr, const char *call) {
+  char *end = (char *)mem_heap_hi() + 1;
+  const char *msg = NULL;
+  unsigned int idx;
+  size_t size;
+  char *pg;
+
+  if (IS_MAPPED(ptr)) {
+    if (!mem_is_mapped((char *)ptr - DSIZE, ptr) ||
+        !mem_is_mapped(MAP_START(ptr), ptr))
+      msg = "not a block in use, a double free?";
+  } else if ((pg = slab_page(ptr)) != NULL) {
+    idx = ((char *)ptr - pg - SLAB_HDR) / SLAB_SLOT(pg);
+    if (((char *)ptr - pg - SLAB_HDR) % SLAB_SLOT(pg) != 0)
+      msg = "pointer into a slab slot";
+    else if (SLAB_BITMAP(pg)[idx / 32] & (1u << (idx % 32)))
+      msg = "double free of a slab slot";
+  } else {
+    size = GET_SIZE(HDRP(ptr));
+    if ((uintptr_t)ptr % ALIGNMENT != 0 || size < MIN_BLOCK_SIZE ||
+        size % ALIGNMENT != 0 || size > (size_t)(end - (char *)ptr))
+      msg = "corrupted header, or not a block";
+    else if (!GET_ALLOC(HDRP(ptr)) || GET(FTRP(ptr)) == FREED(ptr))
+      msg = "double free";
+    else if (GET(FTRP(ptr)) != CANARY(ptr))
+      msg = "canary overwritten, the block overflowed";
+  }
+  if (msg != NULL)
+    harden_fail(call, msg, ptr);
+}
+
+// checks the next MM_CHECK_SLICE blocks, wrapping around at the epilogue;
+// check_next never rests on the epilogue, which realloc and trim move
+static void check_slice(void) {
+  char *first = SEGLIST_ROOT(SEGLIST_CLASSES);
+  char *bp = (check_next != NULL) ? check_next : first;
+  const char *msg;
+
+  check_calls = 0;
+  for (int i = 0; i < MM_CHECK_SLICE; i++) {
+    if ((msg = check_block(bp)) != NULL)
+      harden_fail("check", msg, bp);
+    bp = NEXT_BLKP(bp);
+    if (GET_SIZE(HDRP(bp)) == 0) {
+      if ((msg = check_block(bp)) != NULL)
+        harden_fail("check", msg, bp);
+      bp = first;
+    }
+  }
+  check_next = bp;
+}
+
+static void harden_fail(const char *call, const char *msg, void *bp) {
+  fprintf(stderr, "mm_%s: %s at %p\n", call, msg, bp);
+  abort();
+}
+#endif
+
+#if MM_THREAD_SAFE
+// spin briefly, then yield so a preempted lock holder can run; once in,
+// free what other threads pushed meanwhile
+static void heap_lock_acquire(void) {
+  int spins = 0;
+
+  while (__atomic_exchange_n(&heap_lock, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&heap_lock, __ATOMIC_RELAXED)) {
+      if (++spins < 64)
+        __builtin_ia32_pause();
+      else
+        sched_yield();
+    }
+  }
+  remote_drain();
+}
+
+// bytes the caller may use at ptr
+static size_t usable_size(void *ptr) {
+  char *pg = slab_page(ptr);
+
+  return pg != NULL ? SLAB_SLOT(pg) : GET_SIZE(HDRP(ptr)) - OVERHEAD;
+}
+
+// returns the calling thread's tcache, creating it on first use
+static char *tcache_get(void) {
+  char *tc = tcache;
+
+  if (tc != NULL && tcache_epoch == heap_epoch)
+    return tc;
+
+  LOCK();
+  tc = do_malloc(TC_BYTES);
+  UNLOCK();
+  if (tc == NULL)
+    return NULL;
+
+  memset(tc, 0, TC_BYTES);
+  tcache = tc;
+  tcache_epoch = heap_epoch;
+  pthread_setspecific(tcache_key, tc);
+  return tc;
+}
+
+// slow path of mm_malloc: carve TCACHE_BATCH blocks under a single lock
+static void *tcache_refill(char *tc, int bin) {
+  size_t size = bin * ALIGNMENT;
+  void *bp;
+  void *head = TC_HEAD(tc, bin);
+  unsigned int count = TC_COUNT(tc, bin);
+
+  LOCK();
+  if ((bp = do_malloc(size)) != NULL) {
+    for (int i = 1; i < TCACHE_BATCH; i++) {
+      void *extra = do_malloc(size);
+      if (extra == NULL)
+        break;
+      TC_NEXT(extra) = head;
+      head = extra;
+      count++;
+    }
+  }
+  UNLOCK();
+
+  TC_HEAD(tc, bin) = head;
+  TC_COUNT(tc, bin) = count;
+  return bp;
+}
+
+// slow path of mm_free: return count blocks to the seglists under one lock,
+// or push them on remote_frees at once
+static void tcache_drain(char *tc, int bin, unsigned int count) {
+  void *bp = TC_HEAD(tc, bin);
+  unsigned int moved = 1;
+  void *last;
+
+  if (__atomic_load_n(&remote_free, __ATOMIC_RELAXED) && count > 0 &&
+      bp != NULL) {
+    for (last = bp; moved < count && TC_NEXT(last) != NULL; moved++)
+      last = TC_NEXT(last);
+    TC_HEAD(tc, bin) = TC_NEXT(last);
+    TC_COUNT(tc, bin) -= moved;
+    remote_push(bp, last);
+    return;
+  }
+
+  LOCK();
+  while (count-- > 0 && bp != NULL) {
+    void *next = TC_NEXT(bp);
+    do_free(bp);
+    bp = next;
+    TC_COUNT(tc, bin)--;
+  }
+  UNLOCK();
+
+  TC_HEAD(tc, bin) = bp;
+}
+
+// pushes the chain first..last, linked through TC_NEXT, on remote_frees
+static void remote_push(void *first, void *last) {
+  void *top = __atomic_load_n(&remote_frees, __ATOMIC_RELAXED);
+
+  do
+    TC_NEXT(last) = top;
+  while (!__atomic_compare_exchange_n(&remote_frees, &top, first, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// under the lock: takes the whole stack, so no block is popped twice
+static void remote_drain(void) {
+  void *bp, *next;
+
+  if (__atomic_load_n(&remote_frees, __ATOMIC_RELAXED) == NULL)
+    return;
+  bp = __atomic_exchange_n(&remote_frees, NULL, __ATOMIC_ACQUIRE);
+  for (; bp != NULL; bp = next) {
+    next = TC_NEXT(bp);
+    do_free(bp);
+  }
+}
+
+#if MM_HARDEN
+/*
+ * A block in a tcache still looks in use to check_in_use, but holds the
+ * tcache's address next to its link: only then is the bin searched.
+ */
+static void tcache_check(char *tc, int bin, void *ptr) {
+  char *pg = slab_page(ptr);
+  unsigned int idx;
+  void *bp;
+
+  if (!TC_KEYED(bin) || TC_KEY(ptr) == tc)
+    for (bp = TC_HEAD(tc, bin); bp != NULL; bp = TC_NEXT(bp))
+      if (bp == ptr)
+        harden_fail("free", "double free of a cached block", ptr);
+  if (pg == NULL) {
+    if (GET(FTRP(ptr)) == FREED(ptr))
+      harden_fail("free", "double free", ptr);
+    if (GET(FTRP(ptr)) != CANARY(ptr))
+      harden_fail("free", "canary overwritten, the block overflowed", ptr);
+    return;
+  }
+  idx = ((char *)ptr - pg - SLAB_HDR) / SLAB_SLOT(pg);
+  if (__atomic_load_n(&SLAB_BITMAP(pg)[idx / 32], __ATOMIC_RELAXED) &
+      (1u << (idx % 32)))
+    harden_fail("free", "double free of a slab slot", ptr);
+}
+#endif
+
+// thread exit: give every cached block and the tcache itself back
+static void tcache_release(void *tc) {
+  if (tc != tcache || tcache_epoch != heap_epoch) // heap was reset under us
+    return;
+
+  for (int i = 0; i < TCACHE_BINS; i++)
+    tcache_drain(tc, i, TC_COUNT(tc, i));
+
+  LOCK();
+  do_free(tc);
+  UNLOCK();
+  tcache = NULL;
+}
+#endif
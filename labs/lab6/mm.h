@@ -1,6 +1,122 @@
 #include <stdio.h>
 
+/*
+ * Set MM_THREAD_SAFE to 1 (e.g. -DMM_THREAD_SAFE=1, see the mdriver-mt
+ * target in the Makefile) to build a package that may be called from
+ * several threads at once. mm_init must still be called with no other
+ * thread inside the package.
+ */
+#ifndef MM_THREAD_SAFE
+#define MM_THREAD_SAFE 0
+#endif
+
 extern int mm_init(void);
 extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+
+/*
+ * mm_calloc returns nmemb * size zeroed bytes, or NULL if that overflows.
+ * mm_memalign and mm_aligned_alloc return size bytes at an address that is
+ * a multiple of align, a power of two, or NULL for any other align. Their
+ * blocks are freed and reallocated like mm_malloc's.
+ */
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
+
+/*
+ * Introspection, for debugging and for mdriver's -s/-S time series. None
+ * of it allocates, so it can be called between any two requests.
+ *
+ * mm_walk calls visit on every block of the heap in address order with
+ * its payload, its size in bytes (header included) and one of the
+ * MM_BLOCK_ kinds below, until visit returns nonzero, and returns that
+ * value or 0. Blocks mapped outside the heap are not visited. With
+ * MM_THREAD_SAFE the heap lock is held throughout, so visit must not
+ * call into the package, and blocks in a thread's cache count as
+ * allocated.
+ */
+enum {
+  MM_BLOCK_ALLOC,    /* in use */
+  MM_BLOCK_FREE,     /* on a free list */
+  MM_BLOCK_DEFERRED, /* freed, waiting to be coalesced */
+  MM_BLOCK_SLAB      /* a page of small slots, in use while any slot is */
+};
+
+/* Free-list size classes: class i holds blocks of 2^(i+1) to 2^(i+2)-1 bytes */
+#define MM_STATS_CLASSES 32
+
+/* A snapshot of the heap, filled in by mm_stats */
+typedef struct {
+  size_t heap_bytes;      /* size of the heap */
+  size_t mapped_bytes;    /* blocks mapped outside the heap */
+  size_t alloc_blocks;    /* heap blocks in use, slab pages included */
+  size_t alloc_bytes;     /* ... and their bytes */
+  size_t slab_pages;      /* slab pages */
+  size_t slab_free;       /* bytes of their free slots */
+  size_t deferred_blocks; /* freed blocks not yet coalesced */
+  size_t deferred_bytes;  /* ... and their bytes */
+  size_t free_blocks;     /* blocks on the free lists */
+  size_t free_bytes;      /* ... and their bytes */
+  size_t largest_free;    /* the largest of them */
+  double external_frag;   /* 1 - largest_free / free_bytes */
+
+  /* free blocks and their bytes per class */
+  size_t class_blocks[MM_STATS_CLASSES];
+  size_t class_bytes[MM_STATS_CLASSES];
+} mm_stats_t;
+
+/*
+ * Placement policies for mm_set_fit, for comparing them on the same
+ * heap. Each picks a free block in the seglist class searched, the
+ * request's own class and then the first larger one that is not empty:
+ *   MM_FIT_DEFAULT first fit in the small classes, best fit in the trees
+ *   MM_FIT_FIRST   the first block that fits, in list or descent order
+ *   MM_FIT_NEXT    first fit from where the last search stopped
+ *   MM_FIT_BEST    the smallest block that fits
+ *   MM_FIT_GOOD    the smallest of those met in the first probes probes
+ * mm_set_fit returns 0, or -1 for an unknown policy or good fit without
+ * probes. It may be called at any time and stays in force across mm_init.
+ */
+enum {
+  MM_FIT_DEFAULT,
+  MM_FIT_FIRST,
+  MM_FIT_NEXT,
+  MM_FIT_BEST,
+  MM_FIT_GOOD,
+  MM_FIT_POLICIES /* number of policies */
+};
+
+/* Probes of good fit until mm_set_fit says otherwise */
+#ifndef MM_FIT_PROBES
+#define MM_FIT_PROBES 8
+#endif
+
+extern int mm_set_fit(int policy, unsigned int probes);
+
+/*
+ * With MM_THREAD_SAFE, a free that would have to take the heap lock, of a
+ * block too large for the thread's cache or of half a full cache bin,
+ * pushes the blocks on a lock-free stack instead; the next thread to take
+ * the lock, usually on a malloc slow path, frees them. So a thread that
+ * frees what others allocated never waits for their lock.
+ * mm_set_remote_free(0) makes those frees take the lock again, for
+ * comparison. It returns 0, or -1 without MM_THREAD_SAFE, and stays in
+ * force across mm_init.
+ */
+extern int mm_set_remote_free(int on);
+extern int mm_walk(int (*visit)(void *bp, size_t size, int kind, void *arg),
+                   void *arg);
+extern void mm_stats(mm_stats_t *stats);
+extern void mm_dump(FILE *fp);
+
+/*
+ * mm_check walks the heap and the free lists and returns 0 if they are
+ * consistent, or prints the first problem on stderr and returns -1. It
+ * checks every header and free block's footer, the PREV_ALLOC bits, that
+ * free blocks are coalesced, and that the free lists hold the free blocks
+ * and no others, in the right classes and order; in a -DMM_HARDEN=1 build
+ * also the canaries.
+ */
+extern int mm_check(void);
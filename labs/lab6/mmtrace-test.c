@@ -0,0 +1,37 @@
+/*
+ * mmtrace-test.c - calls for "make test-mmtrace" to capture with
+ *     libmmtrace.so and replay with mdriver64, among them the requests
+ *     for 0 bytes that a trace cannot hold as they are
+ */
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(void) {
+  char *p[8];
+  void *q;
+  int i;
+
+  p[0] = malloc(0);
+  p[1] = calloc(0, 16);
+  p[2] = realloc(NULL, 0);
+  p[3] = memalign(64, 0);
+  if (posix_memalign(&q, 64, 0) != 0)
+    q = NULL;
+  p[4] = q;
+  p[5] = malloc(100);
+  p[5] = realloc(p[5], 0); /* frees it with glibc */
+  p[6] = malloc(0);
+  p[6] = realloc(p[6], 200);
+  p[7] = malloc(300);
+  for (i = 0; i < 8; i++) {
+    if (i != 5 && p[i] == NULL) {
+      fprintf(stderr, "mmtrace-test: request %d failed\n", i);
+      return 1;
+    }
+    free(p[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,837 @@
+/*
+ * mmtrace.c - capture the allocations of a running program as a trace
+ *
+ * Build with "make libmmtrace.so", then run any dynamically linked
+ * program as
+ *
+ *     LD_PRELOAD=./libmmtrace.so MMTRACE_OUT=app.bin ./app
+ *
+ * When the program exits, app.bin (mmtrace.<pid>.bin by default) holds
+ * its malloc, calloc, realloc, free, memalign, posix_memalign and
+ * aligned_alloc calls as a binary trace (see trace.h) that
+ * "mdriver -f app.bin" replays against mm.c.
+ *
+ * Recording never takes a lock. Every thread appends its calls to a
+ * chunk of its own, stamped with a number from one global counter, and
+ * pushes full chunks onto a lock-free stack. A writer thread moves them
+ * to a temporary spool file in the background. At exit the per-thread
+ * streams are merged by sequence number and the trace's block ids are
+ * handed out, reusing the ids of freed blocks.
+ *
+ * A free is numbered before the block is given back and an allocation
+ * after it has been handed out, so two threads can never be seen using
+ * the same block. A realloc is numbered before it is made, so when it
+ * returns a block another thread has just freed, that free can show up
+ * after it; such a free is then applied early, and skipped when it
+ * arrives. Blocks from valloc and pvalloc are not recorded, calls made
+ * before the library is initialized are not either, and forked children
+ * are not traced. A program that leaves through _exit or a
+ * crash writes no trace.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Kinds of recorded call (ALLOC to MEMALIGN come from trace.h) */
+#define EV_NONE (MEMALIGN + 1) /* a realloc that failed and changed nothing */
+
+#define CHUNK_BYTES (1 << 20) /* size of one per-thread event chunk */
+#define CHUNK_EVENTS ((CHUNK_BYTES - sizeof(chunk_t)) / sizeof(event_t))
+#define READ_EVENTS 1024      /* events a merge cursor reads at a time */
+#define FLUSH_NSECS 10000000  /* the writer looks for full chunks (10ms) */
+#define BOOT_BYTES 4096       /* for dlsym's callocs before we are set up */
+#define MAX_SIZE 0xffffffffUL /* largest request a traceop_t holds */
+#define NO_ID (~0u)           /* id of an address that is not live */
+
+/* Is p one of the blocks handed to dlsym before we were set up? */
+#define IS_BOOT(p)                                                             \
+  ((char *)(p) >= boot_buf && (char *)(p) < boot_buf + BOOT_BYTES)
+
+/* Where an address starts looking in the live table */
+#define LIVE_HASH(addr) (((uintptr_t)(addr) >> 4) * 0x9e3779b97f4a7c15ULL)
+
+/* One recorded call */
+typedef struct {
+  uint64_t seq;      /* position among the calls of all threads */
+  uint64_t size;     /* bytes requested (all but FREE) */
+  void *ptr;         /* block returned, or freed for FREE */
+  void *old;         /* block passed to realloc */
+  int type;          /* a request type of trace.h, or EV_NONE */
+  unsigned lg_align; /* log2 of the alignment of a MEMALIGN */
+} event_t;
+
+/* A run of consecutive calls made by one thread */
+typedef struct chunk_t {
+  struct chunk_t *next; /* next chunk on the full stack */
+  unsigned tid;         /* thread that made the calls */
+  unsigned n;           /* events used */
+  event_t ev[];
+} chunk_t;
+
+/* What each recording thread keeps */
+typedef struct tstate_t {
+  struct tstate_t *next_all; /* list of every thread ever seen */
+  chunk_t *cur;              /* chunk being filled, or NULL */
+  unsigned tid;              /* dense thread number */
+  int busy;                  /* set while an event is being added */
+} tstate_t;
+
+/* Where the writer put a chunk in the spool file */
+typedef struct {
+  uint64_t first_seq; /* seq of the first event */
+  off_t offset;       /* file offset of the events */
+  unsigned tid;
+  unsigned n;
+} spooled_t;
+
+/* A thread's stream of events while they are merged */
+typedef struct {
+  spooled_t **chunks; /* this thread's chunks, in order */
+  size_t num_chunks;
+  size_t chunk;     /* chunk being read */
+  unsigned pos;     /* next event of that chunk to read into buf */
+  unsigned buf_pos; /* next unmerged event in buf */
+  unsigned buf_n;   /* events in buf */
+  event_t buf[READ_EVENTS];
+} cursor_t;
+
+/* A live block while ids are handed out */
+typedef struct {
+  void *addr;    /* NULL for an empty slot */
+  unsigned id;   /* NO_ID once freed, while frees are still to skip */
+  unsigned skip; /* frees of addr that were applied early */
+} live_t;
+
+/* The allocator we stand in front of */
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+
+/* Set while recording; cleared at exit and in forked children */
+static int recording = 0;
+
+/* Global call counter, and the number of threads seen */
+static uint64_t next_seq = 0;
+static unsigned next_tid = 0;
+
+/* Thread list and full chunks, both pushed without locks */
+static tstate_t *all_threads = NULL;
+static chunk_t *full_chunks = NULL;
+
+/* Publishes a thread's last chunk when the thread exits */
+static pthread_key_t tstate_key;
+
+/* Background writer and the spool file it fills */
+static pthread_t writer;
+static int writer_stop = 0;
+static FILE *spool = NULL;
+static off_t spool_end = 0;
+static spooled_t *spooled = NULL;
+static size_t num_spooled = 0, max_spooled = 0;
+
+/* Live blocks while the trace is written: address -> id */
+static live_t *live = NULL;
+static size_t live_mask = 0, num_live = 0;
+
+/* Ids of freed blocks, handed out again before new ones */
+static unsigned *free_ids = NULL;
+static size_t num_free = 0, max_free = 0;
+static unsigned next_id = 0;
+
+/* The trace being written */
+static FILE *trace_out = NULL;
+static uint64_t num_ops = 0;
+
+/* Memory for dlsym before real_calloc is known */
+static char boot_buf[BOOT_BYTES];
+static size_t boot_used = 0;
+
+/* Set while this thread is inside the library (or is the writer) */
+static __thread int in_shim __attribute__((tls_model("initial-exec")));
+static __thread tstate_t *tstate __attribute__((tls_model("initial-exec")));
+
+/*
+ * resolve - Look up the allocator that the program would have used
+ */
+static void resolve(void) {
+  static int resolving = 0;
+
+  if (real_malloc != NULL || resolving)
+    return;
+  resolving = 1;
+  real_calloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+  real_malloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+  real_free = (void (*)(void *))dlsym(RTLD_NEXT, "free");
+  real_realloc = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+  real_memalign = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "memalign");
+  real_posix_memalign =
+      (int (*)(void **, size_t, size_t))dlsym(RTLD_NEXT, "posix_memalign");
+  real_aligned_alloc =
+      (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "aligned_alloc");
+  resolving = 0;
+}
+
+/*
+ * thread_state - Return this thread's recording state, creating it the
+ *     first time
+ */
+static tstate_t *thread_state(void) {
+  tstate_t *ts = tstate;
+
+  if (ts != NULL)
+    return ts;
+  if ((ts = real_calloc(1, sizeof(tstate_t))) == NULL)
+    return NULL;
+  ts->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+  ts->next_all = __atomic_load_n(&all_threads, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&all_threads, &ts->next_all, ts, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  pthread_setspecific(tstate_key, ts);
+  return tstate = ts;
+}
+
+/*
+ * publish - Push a chunk onto the stack the writer empties
+ */
+static void publish(chunk_t *c) {
+  c->next = __atomic_load_n(&full_chunks, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&full_chunks, &c->next, c, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+}
+
+/*
+ * begin_event - Number the next call of this thread and return its
+ *     event, or NULL if the call is not to be recorded. The caller fills
+ *     in the event and then calls end_event.
+ */
+static event_t *begin_event(void) {
+  tstate_t *ts;
+  chunk_t *c;
+
+  if (!__atomic_load_n(&recording, __ATOMIC_RELAXED) || in_shim)
+    return NULL;
+  in_shim = 1;
+  if ((ts = thread_state()) == NULL) {
+    in_shim = 0;
+    return NULL;
+  }
+  __atomic_store_n(&ts->busy, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&recording, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n(&ts->busy, 0, __ATOMIC_RELEASE);
+    in_shim = 0;
+    return NULL;
+  }
+
+  /* Start a new chunk once this one is full */
+  if ((c = ts->cur) != NULL && c->n == CHUNK_EVENTS) {
+    publish(c);
+    ts->cur = c = NULL;
+  }
+  if (c == NULL) {
+    c = mmap(NULL, CHUNK_BYTES, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c == MAP_FAILED) {
+      __atomic_store_n(&ts->busy, 0, __ATOMIC_RELEASE);
+      in_shim = 0;
+      return NULL;
+    }
+    c->tid = ts->tid;
+    c->n = 0;
+    ts->cur = c;
+  }
+  c->ev[c->n].seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+  c->ev[c->n].size = 0;
+  c->ev[c->n].ptr = c->ev[c->n].old = NULL;
+  c->ev[c->n].lg_align = 0;
+  return &c->ev[c->n];
+}
+
+/*
+ * end_event - Keep the event that begin_event handed out
+ */
+static void end_event(void) {
+  tstate_t *ts = tstate;
+
+  ts->cur->n++;
+  __atomic_store_n(&ts->busy, 0, __ATOMIC_RELEASE);
+  in_shim = 0;
+}
+
+/*
+ * thread_exit - Hand the writer the last chunk of an exiting thread
+ */
+static void thread_exit(void *arg) {
+  tstate_t *ts = arg;
+  chunk_t *c;
+
+  __atomic_store_n(&ts->busy, 1, __ATOMIC_SEQ_CST);
+  if ((c = ts->cur) != NULL) {
+    ts->cur = NULL;
+    publish(c);
+  }
+  __atomic_store_n(&ts->busy, 0, __ATOMIC_RELEASE);
+}
+
+/*******************************************
+ * The interposed allocator entry points
+ ******************************************/
+
+void *malloc(size_t size) {
+  event_t *e;
+  void *p;
+
+  resolve();
+  p = real_malloc(size);
+  if (p != NULL && size <= MAX_SIZE && (e = begin_event()) != NULL) {
+    e->type = ALLOC;
+    e->ptr = p;
+    e->size = size;
+    end_event();
+  }
+  return p;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  event_t *e;
+  void *p;
+
+  /* dlsym allocates before we know where the real calloc is */
+  if (real_calloc == NULL) {
+    resolve();
+    if (real_calloc == NULL) {
+      size = (nmemb * size + 15) & ~(size_t)15;
+      if (boot_used + size > BOOT_BYTES)
+        return NULL;
+      p = boot_buf + boot_used;
+      boot_used += size;
+      return p;
+    }
+  }
+  p = real_calloc(nmemb, size);
+  if (p != NULL && nmemb * size <= MAX_SIZE && (e = begin_event()) != NULL) {
+    e->type = CALLOC;
+    e->ptr = p;
+    e->size = nmemb * size;
+    end_event();
+  }
+  return p;
+}
+
+/*
+ * record_aligned - Record a block of size bytes handed out at an address
+ *     that is a multiple of align, unless a trace cannot express it
+ */
+static void record_aligned(void *p, size_t align, size_t size) {
+  event_t *e;
+
+  if (p == NULL || size > MAX_SIZE || align == 0 || (align & (align - 1)) ||
+      align > (size_t)1 << TRACE_MAX_LG_ALIGN || (e = begin_event()) == NULL)
+    return;
+  e->type = MEMALIGN;
+  e->ptr = p;
+  e->size = size;
+  e->lg_align = __builtin_ctzl(align);
+  end_event();
+}
+
+void *memalign(size_t align, size_t size) {
+  void *p;
+
+  resolve();
+  p = real_memalign(align, size);
+  record_aligned(p, align, size);
+  return p;
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size) {
+  int err;
+
+  resolve();
+  if ((err = real_posix_memalign(memptr, align, size)) == 0)
+    record_aligned(*memptr, align, size);
+  return err;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+  void *p;
+
+  resolve();
+  p = real_aligned_alloc(align, size);
+  record_aligned(p, align, size);
+  return p;
+}
+
+void free(void *ptr) {
+  event_t *e;
+
+  if (ptr == NULL || IS_BOOT(ptr))
+    return;
+  resolve();
+  if ((e = begin_event()) != NULL) {
+    e->type = FREE;
+    e->ptr = ptr;
+    end_event();
+  }
+  real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size) {
+  event_t *e;
+  void *p;
+
+  resolve();
+  if (size > MAX_SIZE || (e = begin_event()) == NULL)
+    return real_realloc(ptr, size);
+
+  /* Numbered before the call: ptr may be given out again inside it */
+  p = real_realloc(ptr, size);
+  e->old = ptr;
+  e->ptr = p;
+  e->size = size;
+  if (p != NULL) {
+    e->type = (ptr != NULL) ? REALLOC : ALLOC;
+  } else if (ptr != NULL && size == 0) {
+    e->type = FREE; /* glibc frees the block */
+    e->ptr = ptr;
+  } else {
+    e->type = EV_NONE;
+  }
+  end_event();
+  return p;
+}
+
+/*******************************************
+ * The background writer
+ ******************************************/
+
+/*
+ * spool_chunk - Append a chunk's events to the spool file, then unmap it
+ */
+static void spool_chunk(chunk_t *c) {
+  spooled_t *s;
+
+  if (c->n > 0) {
+    if (num_spooled == max_spooled) {
+      max_spooled = max_spooled ? 2 * max_spooled : 1024;
+      spooled = real_realloc(spooled, max_spooled * sizeof(spooled_t));
+      if (spooled == NULL) {
+        fprintf(stderr, "mmtrace: out of memory for the spool index\n");
+        abort();
+      }
+    }
+    s = &spooled[num_spooled++];
+    s->first_seq = c->ev[0].seq;
+    s->offset = spool_end;
+    s->tid = c->tid;
+    s->n = c->n;
+    if (pwrite(fileno(spool), c->ev, c->n * sizeof(event_t), spool_end) !=
+        (ssize_t)(c->n * sizeof(event_t))) {
+      fprintf(stderr, "mmtrace: could not write the spool file\n");
+      abort();
+    }
+    spool_end += c->n * sizeof(event_t);
+  }
+  munmap(c, CHUNK_BYTES);
+}
+
+/*
+ * spool_full - Spool every chunk on the full stack
+ */
+static void spool_full(void) {
+  chunk_t *c, *next;
+
+  for (c = __atomic_exchange_n(&full_chunks, NULL, __ATOMIC_ACQUIRE);
+       c != NULL; c = next) {
+    next = c->next;
+    spool_chunk(c);
+  }
+}
+
+/*
+ * writer_thread - Move full chunks to the spool file until told to stop
+ */
+static void *writer_thread(void *arg) {
+  struct timespec ts = {0, FLUSH_NSECS};
+
+  in_shim = 1;
+  while (!__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) {
+    spool_full();
+    nanosleep(&ts, NULL);
+  }
+  return NULL;
+}
+
+/*******************************************
+ * Turning the spooled events into a trace
+ ******************************************/
+
+/*
+ * cmp_spooled - Order spooled chunks by their first event
+ */
+static int cmp_spooled(const void *a, const void *b) {
+  const spooled_t *x = a, *y = b;
+
+  return (x->first_seq > y->first_seq) - (x->first_seq < y->first_seq);
+}
+
+/*
+ * cursor_next - Return the next event of a thread's stream, or NULL once
+ *     the stream is used up
+ */
+static event_t *cursor_next(cursor_t *cur) {
+  spooled_t *s;
+  unsigned n;
+
+  if (cur->buf_pos < cur->buf_n)
+    return &cur->buf[cur->buf_pos];
+  while (cur->chunk < cur->num_chunks &&
+         cur->pos == cur->chunks[cur->chunk]->n) {
+    cur->chunk++;
+    cur->pos = 0;
+  }
+  if (cur->chunk == cur->num_chunks)
+    return NULL;
+  s = cur->chunks[cur->chunk];
+  n = (s->n - cur->pos < READ_EVENTS) ? s->n - cur->pos : READ_EVENTS;
+  if (pread(fileno(spool), cur->buf, n * sizeof(event_t),
+            s->offset + (off_t)cur->pos * sizeof(event_t)) !=
+      (ssize_t)(n * sizeof(event_t))) {
+    fprintf(stderr, "mmtrace: could not read the spool file\n");
+    abort();
+  }
+  cur->pos += n;
+  cur->buf_pos = 0;
+  cur->buf_n = n;
+  return &cur->buf[0];
+}
+
+/*
+ * live_find - Return the slot of addr in the table of live blocks, or
+ *     the empty slot where it belongs
+ */
+static live_t *live_find(void *addr) {
+  size_t i = LIVE_HASH(addr) & live_mask;
+
+  while (live[i].addr != NULL && live[i].addr != addr)
+    i = (i + 1) & live_mask;
+  return &live[i];
+}
+
+/*
+ * live_delete - Empty a slot of the live table, moving later entries
+ *     back so that every lookup still finds its block
+ */
+static void live_delete(live_t *slot) {
+  size_t i = slot - live, j = i, home;
+
+  num_live--;
+  for (;;) {
+    live[i].addr = NULL;
+    do {
+      j = (j + 1) & live_mask;
+      if (live[j].addr == NULL)
+        return;
+      home = LIVE_HASH(live[j].addr) & live_mask;
+    } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+    live[i] = live[j];
+    i = j;
+  }
+}
+
+/*
+ * live_grow - Keep the live table at most half full
+ */
+static int live_grow(void) {
+  live_t *old = live;
+  size_t i, old_mask = live_mask;
+
+  if (2 * (num_live + 1) <= live_mask)
+    return 0;
+  if ((live = real_calloc(2 * (live_mask + 1), sizeof(live_t))) == NULL)
+    return -1;
+  live_mask = 2 * live_mask + 1;
+  for (i = 0; i <= old_mask; i++)
+    if (old[i].addr != NULL)
+      *live_find(old[i].addr) = old[i];
+  real_free(old);
+  return 0;
+}
+
+/*
+ * emit - Write one trace op
+ */
+static void emit(int type, unsigned id, uint64_t size, unsigned lg_align) {
+  traceop_t op;
+
+  memset(&op, 0, sizeof(op));
+  op.type = type;
+  op.lg_align = lg_align;
+  op.index = id;
+  op.size = size;
+  fwrite(&op, sizeof(op), 1, trace_out);
+  num_ops++;
+}
+
+/*
+ * release - Free the block in a live slot and give its id back. The
+ *     slot is kept as a ghost while frees of the address are pending.
+ */
+static int release(live_t *slot) {
+  unsigned *ids;
+
+  emit(FREE, slot->id, 0, 0);
+  if (num_free == max_free) {
+    max_free = max_free ? 2 * max_free : 1024;
+    if ((ids = real_realloc(free_ids, max_free * sizeof(unsigned))) == NULL)
+      return -1;
+    free_ids = ids;
+  }
+  free_ids[num_free++] = slot->id;
+  slot->id = NO_ID;
+  if (slot->skip == 0)
+    live_delete(slot);
+  return 0;
+}
+
+/*
+ * bind - Give the block just handed out at addr an id (a fresh one if
+ *     id is NO_ID) and return it. A block still live at addr must have
+ *     been freed by a call that is numbered later; that free happens now
+ *     and is skipped when it arrives.
+ */
+static unsigned bind(void *addr, unsigned id) {
+  live_t *slot = live_find(addr);
+
+  if (slot->addr == NULL) {
+    slot->addr = addr;
+    slot->skip = 0;
+    num_live++;
+  } else if (slot->id != NO_ID) {
+    slot->skip++;
+    if (release(slot) < 0)
+      return NO_ID;
+  }
+  if (id == NO_ID)
+    id = (num_free > 0) ? free_ids[--num_free] : next_id++;
+  slot->id = id;
+  return id;
+}
+
+/*
+ * replay_event - Turn one recorded call into trace ops. A request for 0
+ *     bytes still hands out a block that is freed later, but mm_malloc(0)
+ *     returns NULL, so it goes into the trace as a request for 1 byte.
+ */
+static int replay_event(event_t *e) {
+  uint64_t size = (e->size > 0) ? e->size : 1;
+  live_t *slot;
+  unsigned id;
+
+  if (live_grow() < 0)
+    return -1;
+  switch (e->type) {
+  case FREE:
+    slot = live_find(e->ptr);
+    if (slot->addr == NULL)
+      return 0; /* a block we never saw handed out */
+    if (slot->skip > 0) {
+      if (--slot->skip == 0 && slot->id == NO_ID)
+        live_delete(slot);
+      return 0; /* applied early, when its address was reused */
+    }
+    return release(slot);
+
+  case REALLOC:
+    slot = live_find(e->old);
+    if (slot->addr != NULL && slot->id != NO_ID) {
+      id = slot->id;
+      if (e->ptr != e->old) {
+        slot->id = NO_ID;
+        if (slot->skip == 0)
+          live_delete(slot);
+        id = bind(e->ptr, id);
+      }
+      if (id == NO_ID)
+        return -1;
+      emit(REALLOC, id, size, 0);
+      return 0;
+    }
+    /* realloc of a block we never saw: it is new to the trace */
+    /* fall through */
+  case ALLOC:
+  case CALLOC:
+  case MEMALIGN:
+    if ((id = bind(e->ptr, NO_ID)) == NO_ID)
+      return -1;
+    emit(e->type == REALLOC ? ALLOC : e->type, id, size, e->lg_align);
+    return 0;
+  }
+  return 0;
+}
+
+/*
+ * sift_down - Restore the order of the cursor heap below position j
+ */
+static void sift_down(cursor_t **heap, size_t n, size_t j) {
+  cursor_t *tmp;
+  size_t k;
+
+  for (; (k = 2 * j + 1) < n; j = k) {
+    if (k + 1 < n && cursor_next(heap[k + 1])->seq < cursor_next(heap[k])->seq)
+      k++;
+    if (cursor_next(heap[j])->seq <= cursor_next(heap[k])->seq)
+      break;
+    tmp = heap[j], heap[j] = heap[k], heap[k] = tmp;
+  }
+}
+
+/*
+ * write_trace - Merge the spooled streams in call order and write them
+ *     out as a binary trace, giving every block an id
+ */
+static void write_trace(char *path) {
+  cursor_t **heap, *cur;
+  size_t i, n, nthreads = next_tid;
+  tracehdr_t hdr;
+  event_t *e;
+
+  if ((trace_out = fopen(path, "wb")) == NULL) {
+    fprintf(stderr, "mmtrace: could not create %s\n", path);
+    return;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  fwrite(&hdr, sizeof(hdr), 1, trace_out);
+
+  /* Give each thread a cursor over its chunks, in order */
+  qsort(spooled, num_spooled, sizeof(spooled_t), cmp_spooled);
+  heap = real_calloc(nthreads + 1, sizeof(cursor_t *));
+  live_mask = 1023;
+  live = real_calloc(live_mask + 1, sizeof(live_t));
+  if (heap == NULL || live == NULL)
+    goto nomem;
+  for (i = 0; i < num_spooled; i++) {
+    cur = heap[spooled[i].tid];
+    if (cur == NULL &&
+        (cur = heap[spooled[i].tid] = real_calloc(1, sizeof(cursor_t))) == NULL)
+      goto nomem;
+    if ((cur->num_chunks & (cur->num_chunks - 1)) == 0 &&
+        (cur->chunks = real_realloc(cur->chunks, 2 * (cur->num_chunks + 1) *
+                                                     sizeof(spooled_t *))) ==
+            NULL)
+      goto nomem;
+    cur->chunks[cur->num_chunks++] = &spooled[i];
+  }
+
+  /* Merge them through a min-heap keyed by each cursor's next seq */
+  for (i = n = 0; i < nthreads; i++)
+    if (heap[i] != NULL)
+      heap[n++] = heap[i];
+  for (i = n; i-- > 0;)
+    sift_down(heap, n, i);
+  while (n > 0) {
+    e = cursor_next(heap[0]);
+    heap[0]->buf_pos++;
+    if (replay_event(e) < 0)
+      goto nomem;
+    if (cursor_next(heap[0]) == NULL)
+      heap[0] = heap[--n];
+    sift_down(heap, n, 0);
+  }
+
+  /* Now that the counts are known, write the real header */
+  memcpy(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+  hdr.num_ids = next_id;
+  hdr.num_ops = num_ops;
+  hdr.weight = 1;
+  fseek(trace_out, 0, SEEK_SET);
+  fwrite(&hdr, sizeof(hdr), 1, trace_out);
+  if (fclose(trace_out) != 0)
+    fprintf(stderr, "mmtrace: could not write %s\n", path);
+  return;
+
+nomem:
+  fprintf(stderr, "mmtrace: out of memory while writing %s\n", path);
+  fclose(trace_out);
+}
+
+/*******************************************
+ * Setting up and tearing down
+ ******************************************/
+
+/*
+ * stop_in_child - A forked child has no writer, so it records nothing
+ */
+static void stop_in_child(void) {
+  recording = 0;
+}
+
+/*
+ * mmtrace_start - Start the writer and begin recording when the library
+ *     is loaded
+ */
+__attribute__((constructor)) static void mmtrace_start(void) {
+  in_shim = 1;
+  resolve();
+  if (pthread_key_create(&tstate_key, thread_exit) != 0 ||
+      pthread_atfork(NULL, NULL, stop_in_child) != 0 ||
+      (spool = tmpfile()) == NULL ||
+      pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+    fprintf(stderr, "mmtrace: could not start, not recording\n");
+    in_shim = 0;
+    return;
+  }
+  __atomic_store_n(&recording, 1, __ATOMIC_SEQ_CST);
+  in_shim = 0;
+}
+
+/*
+ * mmtrace_stop - Stop recording when the program exits, and write the
+ *     trace
+ */
+__attribute__((destructor)) static void mmtrace_stop(void) {
+  char path[64], *out = getenv("MMTRACE_OUT");
+  tstate_t *ts;
+
+  if (!__atomic_load_n(&recording, __ATOMIC_SEQ_CST))
+    return;
+  in_shim = 1;
+  __atomic_store_n(&recording, 0, __ATOMIC_SEQ_CST);
+
+  /* Wait out calls being recorded right now, then stop the writer */
+  for (ts = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE); ts != NULL;
+       ts = ts->next_all)
+    while (__atomic_load_n(&ts->busy, __ATOMIC_ACQUIRE))
+      sched_yield();
+  __atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+  pthread_join(writer, NULL);
+
+  /* Spool what is left, including the chunks still being filled */
+  spool_full();
+  for (ts = all_threads; ts != NULL; ts = ts->next_all)
+    if (ts->cur != NULL) {
+      spool_chunk(ts->cur);
+      ts->cur = NULL;
+    }
+
+  if (out == NULL) {
+    sprintf(path, "mmtrace.%d.bin", (int)getpid());
+    out = path;
+  }
+  write_trace(out);
+}
@@ -0,0 +1,109 @@
+/*
+ * rep2bin.c - convert a text .rep trace into the binary format of trace.h
+ *
+ * Usage: rep2bin [<in.rep> [<out.bin>]]
+ *
+ * Reads from stdin and writes to stdout when no files are given, one
+ * request at a time, so traces of any length can be piped through it,
+ * e.g. "zcat big.rep.gz | ./rep2bin > big.bin". The counts in the .rep
+ * header are written first; if the requests do not match them and the
+ * output can be rewound, the header is rewritten with the real counts.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+static void app_error(char *msg) {
+  fprintf(stderr, "rep2bin: %s\n", msg);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  FILE *in = stdin;
+  FILE *out = stdout;
+  tracehdr_t hdr;
+  traceop_t op;
+  long sugg_heapsize, num_ids, num_ops, weight;
+  unsigned long long index, size, align, max_id = 0;
+  uint64_t ops = 0;
+  char type;
+
+  if (argc > 3 || (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0')) {
+    fprintf(stderr, "Usage: rep2bin [<in.rep> [<out.bin>]]\n");
+    exit(1);
+  }
+  if (argc > 1 && strcmp(argv[1], "-") != 0 &&
+      (in = fopen(argv[1], "r")) == NULL)
+    app_error("could not open the input trace");
+  if (argc > 2 && (out = fopen(argv[2], "wb")) == NULL)
+    app_error("could not create the output trace");
+
+  /* The .rep header gives the heap size, ids, ops and weight */
+  if (fscanf(in, "%ld %ld %ld %ld", &sugg_heapsize, &num_ids, &num_ops,
+             &weight) != 4)
+    app_error("missing .rep header");
+  memset(&hdr, 0, sizeof(hdr));
+  memset(&op, 0, sizeof(op));
+  memcpy(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+  hdr.sugg_heapsize = sugg_heapsize;
+  hdr.num_ids = num_ids;
+  hdr.num_ops = num_ops;
+  hdr.weight = weight;
+  if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+    app_error("write failed");
+
+  /* Pack every request line into a 12-byte record */
+  while (fscanf(in, " %c", &type) == 1) {
+    size = 0;
+    op.lg_align = 0;
+    switch (type) {
+    case 'a':
+    case 'r':
+    case 'c':
+      if (fscanf(in, "%llu %llu", &index, &size) != 2)
+        app_error("truncated alloc, realloc or calloc request");
+      op.type = (type == 'a') ? ALLOC : (type == 'r') ? REALLOC : CALLOC;
+      break;
+    case 'm':
+      if (fscanf(in, "%llu %llu %llu", &index, &align, &size) != 3)
+        app_error("truncated memalign request");
+      if (align == 0 || (align & (align - 1)) != 0 ||
+          align > 1ull << TRACE_MAX_LG_ALIGN)
+        app_error("memalign alignment is not a power of two up to 2^31");
+      op.type = MEMALIGN;
+      op.lg_align = __builtin_ctzll(align);
+      break;
+    case 'f':
+      if (fscanf(in, "%llu", &index) != 1)
+        app_error("truncated free request");
+      op.type = FREE;
+      break;
+    default:
+      app_error("bogus request type");
+    }
+    if (index > TRACE_MAX_ID || size > UINT32_MAX)
+      app_error("id or size too large for the binary format");
+    op.index = index;
+    op.size = size;
+    max_id = (index > max_id) ? index : max_id;
+    if (fwrite(&op, sizeof(op), 1, out) != 1)
+      app_error("write failed");
+    ops++;
+  }
+
+  /* Fix up the header if the .rep header was wrong */
+  if (ops != hdr.num_ops || (ops > 0 && max_id + 1 != hdr.num_ids)) {
+    hdr.num_ops = ops;
+    hdr.num_ids = (ops > 0) ? max_id + 1 : 0;
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+      app_error("request counts differ from the header of a piped trace");
+  }
+  if (fclose(out) != 0)
+    app_error("write failed");
+  return 0;
+}
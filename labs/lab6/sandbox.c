@@ -1,3 +1,8 @@
+/*
+ * sandbox.c - A plain implicit-list allocator: first fit over every
+ * block, boundary tags and immediate coalescing. mdriver links it in as
+ * the "implicit" allocator of -A; it also works as a drop-in mm.c.
+ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -40,8 +45,13 @@
 #define SET_PREV(bp, val) (PUT_P(PREVRP(bp), val));
 #define SET_NEXT(bp, val) (PUT_P(NEXTRP(bp), val));
 
+// payloads are aligned like glibc's: 8 bytes on i386, 16 bytes on x86-64
+#if defined(__x86_64__)
+#define ALIGNMENT 16
+#else
 #define ALIGNMENT 8
-#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~0x7)
+#endif
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
 
 static void *extend_heap(size_t words);
 static void *coalesce(void *bp);
@@ -0,0 +1,53 @@
+/*
+ * trace.h - the binary trace format read by mdriver and written by rep2bin
+ *
+ * A binary trace is a tracehdr_t followed directly by num_ops traceop_t
+ * records, in the byte order of the machine that wrote it. mdriver maps
+ * the file and replays the records in place, so nothing is parsed and
+ * the trace only has to fit in the page cache, not in memory.
+ */
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * The first 8 bytes of every binary trace (there is no terminating 0). The
+ * last one is the version of the format.
+ */
+#define TRACE_MAGIC "MMTRACE3"
+#define TRACE_MAGIC_LEN 8
+
+/* Largest block id a traceop_t can hold */
+#define TRACE_MAX_ID UINT32_MAX
+
+/* Kinds of request: malloc, free, realloc, calloc(1, size) and memalign */
+enum { ALLOC, FREE, REALLOC, CALLOC, MEMALIGN };
+
+/* Largest alignment, and the alignment a MEMALIGN op asks for */
+#define TRACE_MAX_LG_ALIGN 31
+#define TRACE_ALIGN(op) ((size_t)1 << (op)->lg_align)
+
+/* The fixed header at the start of a binary trace (32 bytes) */
+typedef struct {
+  char magic[TRACE_MAGIC_LEN]; /* TRACE_MAGIC */
+  uint64_t num_ids;            /* number of block ids */
+  uint64_t num_ops;            /* number of op records that follow */
+  uint32_t sugg_heapsize;      /* suggested heap size (unused) */
+  uint32_t weight;             /* weight for this trace (unused) */
+} tracehdr_t;
+
+/*
+ * Characterizes a single trace operation (allocator request). This is
+ * both the 12-byte record of a binary trace and what mdriver works from,
+ * so a mapped trace is used as it is. Every index is below num_ids.
+ */
+typedef struct {
+  uint32_t index;   /* index for free() to use later */
+  uint32_t size;    /* byte size of the request, 0 for FREE */
+  uint8_t type;     /* ALLOC, FREE, REALLOC, CALLOC or MEMALIGN */
+  uint8_t lg_align; /* log2 of the MEMALIGN alignment, else 0 */
+  uint16_t unused;  /* 0 */
+} traceop_t;
+
+#endif /* __TRACE_H_ */